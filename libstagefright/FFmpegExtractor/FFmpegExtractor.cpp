@@ -42,6 +42,7 @@
 
 #include "utils/codec_utils.h"
 #include "utils/ffmpeg_cmdutils.h"
+#include "utils/packet_ref.h"
 
 #include "FFmpegExtractor.h"
 
@@ -94,6 +95,10 @@ private:
     size_t mNALLengthSize;
     bool mNal2AnnexB;
 
+    //pass packets by reference, see packet_ref.h
+    bool mPacketRef;
+    int mPacketRefSource;
+
     AVStream *mStream;
     PacketQueue *mQueue;
 
@@ -321,6 +326,7 @@ bool FFmpegExtractor::is_codec_supported(enum AVCodecID codec_id)
     case AV_CODEC_ID_FLV1:
     case AV_CODEC_ID_VORBIS:
     case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_VP9:
 
         supported = true;
         break;
@@ -391,6 +397,9 @@ sp<MetaData> FFmpegExtractor::setVideoFormat(AVStream *stream)
     case AV_CODEC_ID_HEVC:
         meta = setHEVCFormat(avctx);
         break;
+    case AV_CODEC_ID_VP9:
+        meta = setVP9Format(avctx);
+        break;
     default:
         ALOGD("unsuppoted video codec(id:%d, name:%s), but give it a chance",
                 avctx->codec_id, avcodec_get_name(avctx->codec_id));
@@ -414,6 +423,7 @@ sp<MetaData> FFmpegExtractor::setVideoFormat(AVStream *stream)
             meta->setInt32(kKeyBitRate, avctx->bit_rate);
         }
         setDurationMetaData(stream, meta);
+        setCodecParamsMetaData(stream, meta);
     }
 
     return meta;
@@ -493,6 +503,7 @@ sp<MetaData> FFmpegExtractor::setAudioFormat(AVStream *stream)
         meta->setInt32(kKeyBlockAlign, avctx->block_align);
         meta->setInt32(kKeySampleFormat, avctx->sample_fmt);
         setDurationMetaData(stream, meta);
+        setCodecParamsMetaData(stream, meta);
     }
 
     return meta;
@@ -518,6 +529,65 @@ void FFmpegExtractor::setDurationMetaData(AVStream *stream, sp<MetaData> &meta)
     }
 }
 
+//the OMX.ffmpeg.* decoders take the codec parameters as they are,
+//instead of rebuilding them from the codec specific data
+void FFmpegExtractor::setCodecParamsMetaData(AVStream *stream, sp<MetaData> &meta)
+{
+    int32_t delay = 0, padding = 0;
+
+    //not kKeyEncoderDelay/kKeyEncoderPadding, OMXCodec would cut them
+    //a second time
+    if (stream->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+        getGaplessInfo(stream, &delay, &padding);
+    }
+
+    sp<ABuffer> params = packCodecParams(stream->codec, delay, padding);
+
+    if (params != NULL) {
+        meta->setData(kKeyFFmpegCodecParams, 0, params->data(), params->size());
+    }
+}
+
+//samples the encoder put in front of and behind the audio, 0 if unknown:
+//iTunSMPB as iTunes writes it, else what the demuxer found itself, e.g.
+//the LAME/Xing header of mp3 or the edit list of mp4
+void FFmpegExtractor::getGaplessInfo(AVStream *stream,
+        int32_t *delay, int32_t *padding)
+{
+    AVDictionaryEntry *tag = NULL;
+    unsigned int d = 0, p = 0;
+    ssize_t index;
+
+    *delay = 0;
+    *padding = 0;
+
+    tag = av_dict_get(stream->metadata, "iTunSMPB", NULL, 0);
+    if (!tag) {
+        tag = av_dict_get(mFormatCtx->metadata, "iTunSMPB", NULL, 0);
+    }
+    //" 00000000 00000840 000001CA 0000000000045F76 ...", in hex: zero,
+    //delay, padding, original length
+    if (tag && sscanf(tag->value, " %*x %x %x", &d, &p) == 2) {
+        *delay = d;
+        *padding = p;
+    } else {
+        index = mSkipSamples.indexOfKey(stream->index);
+        if (index >= 0) {
+            *delay = mSkipSamples.valueAt(index);
+        }
+        //the samples the demuxer drops from the last packets
+        if (stream->first_discard_sample > 0
+                && stream->last_discard_sample > stream->first_discard_sample) {
+            *padding = stream->last_discard_sample - stream->first_discard_sample;
+        }
+    }
+
+    if (*delay > 0 || *padding > 0) {
+        ALOGI("gapless: encoder delay %d, padding %d samples%s",
+                *delay, *padding, tag ? " (iTunSMPB)" : "");
+    }
+}
+
 int FFmpegExtractor::stream_component_open(int stream_index)
 {
     TrackInfo *trackInfo = NULL;
@@ -858,6 +928,14 @@ int FFmpegExtractor::initStreams()
         goto fail;
     }
 
+    //the encoder delay the demuxer found, before the packets take it
+    mSkipSamples.clear();
+    for (i = 0; i < (int)mFormatCtx->nb_streams; i++) {
+        if (mFormatCtx->streams[i]->skip_samples > 0) {
+            mSkipSamples.add(i, mFormatCtx->streams[i]->skip_samples);
+        }
+    }
+
     if ((t = av_dict_get(format_opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
         ALOGE("Option %s not found.\n", t->key);
         //ret = AVERROR_OPTION_NOT_FOUND;
@@ -1207,6 +1285,8 @@ FFmpegSource::FFmpegSource(
       mTrackIndex(index),
       mIsAVC(false),
       mNal2AnnexB(false),
+      mPacketRef(false),
+      mPacketRefSource(0),
       mStream(mExtractor->mTracks.itemAt(index).mStream),
       mQueue(mExtractor->mTracks.itemAt(index).mQueue) {
     sp<MetaData> meta = mExtractor->mTracks.itemAt(index).mMeta;
@@ -1241,12 +1321,29 @@ FFmpegSource::FFmpegSource(
 
     mMediaType = mStream->codec->codec_type;
     mFirstKeyPktTimestamp = AV_NOPTS_VALUE;
+
+    //audio packets are too small to be worth it
+    mPacketRef = mMediaType == AVMEDIA_TYPE_VIDEO && packet_ref_enabled();
+    if (mPacketRef) {
+        mPacketRefSource = packet_ref_open_source();
+        ALOGI("%s packets are passed by reference",
+                av_get_media_type_string(mMediaType));
+    }
 }
 
 FFmpegSource::~FFmpegSource() {
+    PacketRefStats stats;
+
     ALOGV("FFmpegSource::~FFmpegSource %s",
             av_get_media_type_string(mMediaType));
     mExtractor = NULL;
+
+    if (mPacketRef) {
+        packet_ref_close_source(mPacketRefSource);
+    }
+    packet_ref_get_stats(&stats);
+    ALOGD("packets by reference: %lld (%lld dropped), payload copies: %lld (%lld bytes)",
+            stats.by_ref, stats.dropped, stats.copies, stats.copied_bytes);
 }
 
 status_t FFmpegSource::start(MetaData *params) {
@@ -1359,29 +1456,6 @@ retry:
             goto retry;
     }
 
-    MediaBuffer *mediaBuffer = new MediaBuffer(pkt.size + FF_INPUT_BUFFER_PADDING_SIZE);
-    mediaBuffer->meta_data()->clear();
-    mediaBuffer->set_range(0, pkt.size);
-
-    //copy data
-    if (mIsAVC && mNal2AnnexB) {
-        /* This only works for NAL sizes 3-4 */
-        CHECK(mNALLengthSize == 3 || mNALLengthSize == 4);
-
-        uint8_t *dst = (uint8_t *)mediaBuffer->data();
-        /* Convert H.264 NAL format to annex b */
-        status = convertNal2AnnexB(dst, pkt.size, pkt.data, pkt.size, mNALLengthSize);
-        if (status != OK) {
-            ALOGE("convertNal2AnnexB failed");
-            mediaBuffer->release();
-            mediaBuffer = NULL;
-            av_free_packet(&pkt);
-            return ERROR_MALFORMED;
-        }
-    } else {
-        memcpy(mediaBuffer->data(), pkt.data, pkt.size);
-    }
-
     int64_t start_time = mStream->start_time != AV_NOPTS_VALUE ? mStream->start_time : 0;
     if (pktTS != AV_NOPTS_VALUE)
         timeUs = (int64_t)((pktTS - start_time) * av_q2d(mStream->time_base) * 1000000);
@@ -1397,6 +1471,59 @@ retry:
             av_get_media_type_string(mMediaType), pkt.size, key);
 #endif
 
+    MediaBuffer *mediaBuffer = NULL;
+    bool annexB = mIsAVC && mNal2AnnexB;
+
+    /* This only works for NAL sizes 3-4 */
+    if (annexB) {
+        CHECK(mNALLengthSize == 3 || mNALLengthSize == 4);
+    }
+
+    //hand the packet itself over, converted in place if nobody else
+    //references its data, the payload is not copied at all
+    if (mPacketRef && pkt.buf && (!annexB || av_buffer_is_writable(pkt.buf))) {
+        PacketRefToken token;
+
+        if (annexB) {
+            status = convertNal2AnnexB(pkt.data, pkt.size, pkt.data, pkt.size, mNALLengthSize);
+            if (status != OK) {
+                ALOGE("convertNal2AnnexB failed");
+                av_free_packet(&pkt);
+                return ERROR_MALFORMED;
+            }
+            annexB = false;
+        }
+
+        if (packet_ref_put(mPacketRefSource, &pkt, &token) == 0) {
+            mediaBuffer = new MediaBuffer(sizeof(token));
+            mediaBuffer->meta_data()->clear();
+            memcpy(mediaBuffer->data(), &token, sizeof(token));
+        }
+    }
+
+    if (mediaBuffer == NULL) {
+        mediaBuffer = new MediaBuffer(pkt.size + FF_INPUT_BUFFER_PADDING_SIZE);
+        mediaBuffer->meta_data()->clear();
+        mediaBuffer->set_range(0, pkt.size);
+
+        //copy data
+        if (annexB) {
+            uint8_t *dst = (uint8_t *)mediaBuffer->data();
+            /* Convert H.264 NAL format to annex b */
+            status = convertNal2AnnexB(dst, pkt.size, pkt.data, pkt.size, mNALLengthSize);
+            if (status != OK) {
+                ALOGE("convertNal2AnnexB failed");
+                mediaBuffer->release();
+                mediaBuffer = NULL;
+                av_free_packet(&pkt);
+                return ERROR_MALFORMED;
+            }
+        } else {
+            memcpy(mediaBuffer->data(), pkt.data, pkt.size);
+        }
+        packet_ref_count_copy(pkt.size);
+    }
+
     mediaBuffer->meta_data()->setInt64(kKeyTime, timeUs);
     mediaBuffer->meta_data()->setInt32(kKeyIsSyncFrame, key);
 
@@ -98,6 +98,9 @@ private:
     bool mDefersToCreateAudioTrack;
     AVBitStreamFilterContext *mVideoBsfc;
     AVBitStreamFilterContext *mAudioBsfc;
+    //stream index -> skip_samples of the demuxer, which
+    //avformat_find_stream_info() moves into the first packet
+    KeyedVector<int, int32_t> mSkipSamples;
 
     static int decode_interrupt_cb(void *ctx);
     int initStreams();
@@ -109,6 +112,8 @@ private:
     sp<MetaData> setVideoFormat(AVStream *stream);
     sp<MetaData> setAudioFormat(AVStream *stream);
     void setDurationMetaData(AVStream *stream, sp<MetaData> &meta);
+    void setCodecParamsMetaData(AVStream *stream, sp<MetaData> &meta);
+    void getGaplessInfo(AVStream *stream, int32_t *delay, int32_t *padding);
     int stream_component_open(int stream_index);
     void stream_component_close(int stream_index);
     void reachedEOS(enum AVMediaType media_type);
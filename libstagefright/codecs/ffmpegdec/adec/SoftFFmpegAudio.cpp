@@ -20,15 +20,72 @@
 
 #include "SoftFFmpegAudio.h"
 
+#include <cutils/properties.h>
+
+#include <time.h>
+
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/MediaDefs.h>
 
+#include "utils/audio_utils.h"
+#include "utils/codec_pool.h"
+#include "utils/codec_utils.h"
+#include "utils/ffmpeg_omx_ext.h"
+
 #define DEBUG_PKT 0
 #define DEBUG_FRM 0
+#define DEBUG_MEM 0 //per-instance memory of the audio buffers
+#define DEBUG_CPU 0 //cpu time per second of decoded audio
+#define DEBUG_KERNELS 0 //audio kernels against swresample, output and speed
+#define DEBUG_SPDIF 0 //dump the IEC 61937 output, see passthroughAudio()
+#define DEBUG_BATCH 0 //output buffers per second of audio
+#define DEBUG_AHEAD 0 //decoded audio ready ahead of the output
 
 namespace android {
 
+//the 768KB which mAudioBuffer used to be inside each instance
+static const size_t kInlineAudioBufferSize = 192000 * 4;
+
+Mutex SoftFFmpegAudio::sAudioPoolLock;
+AVBufferPool *SoftFFmpegAudio::sAudioPool = NULL;
+int SoftFFmpegAudio::sAudioPoolSize = 0;
+int SoftFFmpegAudio::sAudioPoolUsers = 0;
+
+static const int32_t kMaxOutputBufferSize = 128 * 1024;
+static const int32_t kMaxOutputBuffers = 16;
+//at least this much audio across all output buffers
+static const int64_t kMinQueuedUs = 100000;
+//per output buffer in low-power mode
+static const int64_t kLowPowerBufferUs = 250000;
+
+//packets queued to the decode workers ahead of the output, per worker
+static const size_t kMaxDecodeJobsPerWorker = 2;
+//the most decoded audio kept ready in decode-ahead mode
+static const int64_t kMaxDecodeAheadUs = 2000000;
+
+//beyond that the encoder delay or padding is taken for garbage
+static const int32_t kMaxEncoderDelay = 1 << 16;
+
+static const int kMaxChannels = 8;
+static const int kMaxSampleRate = 192000;
+
+static OMX_AUDIO_CHANNELTYPE getOMXChannel(uint64_t channel) {
+    switch (channel) {
+    case AV_CH_FRONT_LEFT:     return OMX_AUDIO_ChannelLF;
+    case AV_CH_FRONT_RIGHT:    return OMX_AUDIO_ChannelRF;
+    case AV_CH_FRONT_CENTER:   return OMX_AUDIO_ChannelCF;
+    case AV_CH_LOW_FREQUENCY:  return OMX_AUDIO_ChannelLFE;
+    case AV_CH_BACK_LEFT:      return OMX_AUDIO_ChannelLR;
+    case AV_CH_BACK_RIGHT:     return OMX_AUDIO_ChannelRR;
+    case AV_CH_BACK_CENTER:    return OMX_AUDIO_ChannelCS;
+    case AV_CH_SIDE_LEFT:      return OMX_AUDIO_ChannelLS;
+    case AV_CH_SIDE_RIGHT:     return OMX_AUDIO_ChannelRS;
+    default:                   return OMX_AUDIO_ChannelNone;
+    }
+}
+
 template<class T>
 static void InitOMXParams(T *params) {
     params->nSize = sizeof(T);
@@ -85,24 +142,112 @@ SoftFFmpegAudio::SoftFFmpegAudio(
       mSignalledError(false),
       mAudioClock(0),
       mInputBufferSize(0),
+      mCpuUs(0),
+      mCpuSamples(0),
+      mConvertedFrames(0),
+      mDecodedFrames(0),
+      mAudioBuffer(NULL),
       mResampledData(NULL),
       mResampledDataSize(0),
+      mLastFrameSamples(0),
+      mAudioKernels(true),
+      mLowPower(false),
+      mOutputFilled(0),
+      mBatchOutput(true),
+      mBatchBytes(0),
+      mBatchBuffers(0),
+      mMaxOutputChannels(2),
+      mMaxOutputFreq(48000),
+      mFloatOutput(false),
+      mPassthrough(false),
+      mParser(NULL),
+      mSpdif(NULL),
+      mNumDecodeWorkers(0),
+      mDecodeWorkersRunning(0),
+      mStopDecode(false),
+      mDecodeAheadUs(0),
+      mDecodedUs(0),
+      mDecodeDrainQueued(false),
+      mDecodeUnderruns(0),
+      mDecodeStarved(true),
+      mLevelMinUs(0),
+      mLevelSumUs(0),
+      mLevelSpanUs(0),
+      mEncoderDelay(0),
+      mEncoderPadding(0),
+      mSkipSamples(0),
+      mCheckSkip(true),
+      mNumHeldBuffers(0),
+      mHeldBytes(0),
       mOutputPortSettingsChange(NONE) {
 
     setMode(name);
 
+    //setprop sys.media.adec.lowpower 1 for fewer, larger output buffers,
+    //e.g. while the screen is off
+    char value[PROPERTY_VALUE_MAX];
+    property_get("sys.media.adec.lowpower", value, "0");
+    mLowPower = atoi(value) != 0;
+
+    //setprop sys.media.adec.batch 0 returns each frame in a buffer of its own
+    property_get("sys.media.adec.batch", value, "1");
+    mBatchOutput = atoi(value) != 0;
+
+    //multichannel and high rate output for clients which don't set
+    //OMX.ffmpeg.index.audioOutputCaps, e.g. sys.media.adec.maxchannels 8
+    property_get("sys.media.adec.maxchannels", value, "2");
+    mMaxOutputChannels = av_clip(atoi(value), 1, kMaxChannels);
+    property_get("sys.media.adec.maxrate", value, "48000");
+    mMaxOutputFreq = av_clip(atoi(value), 48000, kMaxSampleRate);
+
+    //AC3/DTS passthrough for clients which don't set
+    //OMX.ffmpeg.index.audioPassthrough, only if the sink is a receiver
+    if (mMode == MODE_AC3 || mMode == MODE_DTS) {
+        property_get("sys.media.adec.passthrough", value, "0");
+        mPassthrough = atoi(value) != 0;
+    }
+
+    //setprop sys.media.adec.decodeahead 500 keeps 500ms of audio decoded
+    //ahead on a worker thread, for codecs with costly frames
+    property_get("sys.media.adec.decodeahead", value, "0");
+    mDecodeAheadUs = av_clip(atoi(value), 0, kMaxDecodeAheadUs / 1000) * 1000LL;
+
+    //setprop sys.media.adec.kernels 0 leaves all conversions to swresample
+    property_get("sys.media.adec.kernels", value, "1");
+    mAudioKernels = atoi(value) != 0;
+
     ALOGD("SoftFFmpegAudio component: %s mMode: %d", name, mMode);
 
+    {
+        Mutex::Autolock autoLock(sAudioPoolLock);
+        sAudioPoolUsers++;
+    }
+
     initPorts();
     CHECK_EQ(initDecoder(), (status_t)OK);
 }
 
 SoftFFmpegAudio::~SoftFFmpegAudio() {
     ALOGV("~SoftFFmpegAudio");
+#if DEBUG_MEM
+    ALOGI("audio buffers of %s: instance %u bytes, shared resample buffers "
+            "%d bytes each, %d instances (before: instance %u bytes with "
+            "the buffers inline)",
+            mCtx && mCtx->codec ? mCtx->codec->name : "none",
+            sizeof(*this), sAudioPoolSize, sAudioPoolUsers,
+            sizeof(*this) + kInlineAudioBufferSize + kOutputBufferSize);
+#endif
     deInitDecoder();
     if (mFFmpegAlreadyInited) {
         deInitFFmpeg();
     }
+
+    //the buffers go once the last of them is returned
+    Mutex::Autolock autoLock(sAudioPoolLock);
+    if (--sAudioPoolUsers == 0) {
+        av_buffer_pool_uninit(&sAudioPool);
+        sAudioPoolSize = 0;
+    }
 }
 
 void SoftFFmpegAudio::initInputFormat(uint32_t mode,
@@ -325,25 +470,19 @@ status_t SoftFFmpegAudio::initDecoder() {
 
     initVorbisHdr();
 
-    memset(mSilenceBuffer, 0, kOutputBufferSize);
-
     return OK;
 }
 
 void SoftFFmpegAudio::deInitDecoder() {
+    stopDecodeWorkers();
     if (mCtx) {
-        if (!mCtx->extradata) {
-            av_free(mCtx->extradata);
-            mCtx->extradata = NULL;
-            mCtx->extradata_size = 0;
-        }
-
         deinitVorbisHdr();
 
+        //kept warm for the next instance, extradata included
         if (mCodecAlreadyOpened) {
-            avcodec_close(mCtx);
-            av_free(mCtx);
-            mCtx = NULL;
+            codec_pool_close(&mCtx);
+        } else {
+            codec_pool_free_context(&mCtx);
         }
     }
     if (mFrame) {
@@ -354,6 +493,8 @@ void SoftFFmpegAudio::deInitDecoder() {
         swr_free(&mSwrCtx);
         mSwrCtx = NULL;
     }
+    av_buffer_unref(&mAudioBuffer);
+    deinitPassthrough();
 }
 
 OMX_ERRORTYPE SoftFFmpegAudio::internalGetParameter(
@@ -369,13 +510,25 @@ OMX_ERRORTYPE SoftFFmpegAudio::internalGetParameter(
                 return OMX_ErrorUndefined;
             }
 
-            profile->eNumData = OMX_NumericalDataSigned;
+            //IEC 61937 bursts are 16-bit whatever was asked for
+            bool floatOutput = mFloatOutput && !mPassthrough;
+            profile->eNumData = floatOutput ?
+                OMX_NumericalDataFFmpegFloat : OMX_NumericalDataSigned;
             profile->eEndian = OMX_EndianBig;
             profile->bInterleaved = OMX_TRUE;
-            profile->nBitPerSample = 16;
+            profile->nBitPerSample = floatOutput ? 32 : 16;
             profile->ePCMMode = OMX_AUDIO_PCMModeLinear;
             profile->eChannelMapping[0] = OMX_AUDIO_ChannelLF;
             profile->eChannelMapping[1] = OMX_AUDIO_ChannelRF;
+            if (mAudioTgtChannels > 2) {
+                //channels come in the order of the layout bits
+                uint64_t layout = mAudioTgtChannelLayout;
+                for (int i = 0; i < mAudioTgtChannels && i < OMX_AUDIO_MAXCHANNELS; i++) {
+                    uint64_t channel = layout & -layout;
+                    profile->eChannelMapping[i] = getOMXChannel(channel);
+                    layout &= ~channel;
+                }
+            }
 
             profile->nChannels = mAudioTgtChannels;
             profile->nSamplingRate = mAudioTgtFreq;
@@ -600,6 +753,35 @@ OMX_ERRORTYPE SoftFFmpegAudio::internalGetParameter(
             return OMX_ErrorNone;
         }
 
+        case OMX_IndexParamFFmpegAudioOutputCaps:
+        {
+            OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE *caps =
+                (OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE *)params;
+
+            if (caps->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            caps->nMaxChannels = mMaxOutputChannels;
+            caps->nMaxSampleRate = mMaxOutputFreq;
+
+            return OMX_ErrorNone;
+        }
+
+        case OMX_IndexParamFFmpegAudioPassthrough:
+        {
+            OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE *passthrough =
+                (OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE *)params;
+
+            if (passthrough->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            passthrough->bEnable = mPassthrough ? OMX_TRUE : OMX_FALSE;
+
+            return OMX_ErrorNone;
+        }
+
         default:
 
             return SimpleSoftOMXComponent::internalGetParameter(index, params);
@@ -692,13 +874,17 @@ void SoftFFmpegAudio::adjustAudioParams() {
     mAudioSrcChannelLayout = av_get_default_channel_layout(mAudioSrcChannels);
 
     //target
-    //channels support 1 or 2
-    channels = channels >= 2 ? 2 : 1;
-    //4000 <= sampling rate <= 48000
+    //as many channels as the sink takes, else 5.1 or stereo or mono
+    if (channels > mMaxOutputChannels) {
+        channels = mMaxOutputChannels >= 6 ? 6 : (mMaxOutputChannels >= 2 ? 2 : 1);
+    } else if (channels < 1) {
+        channels = 1;
+    }
+    //4000 <= sampling rate <= what the sink takes, 48000 by default
     if (sampling_rate < 4000) {
         sampling_rate = 4000;
-    } else if (sampling_rate > 48000) {
-        sampling_rate = 48000;
+    } else if (sampling_rate > mMaxOutputFreq) {
+        sampling_rate = mMaxOutputFreq;
     }
 
     if (mAudioTgtChannels == 0) {
@@ -707,8 +893,83 @@ void SoftFFmpegAudio::adjustAudioParams() {
     if (mAudioTgtFreq == 0) {
         mAudioTgtFreq = sampling_rate;
     }
-    mAudioTgtFmt = AV_SAMPLE_FMT_S16; //FIXME
+    mAudioTgtFmt = mFloatOutput ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
     mAudioTgtChannelLayout = av_get_default_channel_layout(mAudioTgtChannels);
+
+    //IEC 61937 bursts are 16-bit stereo, whatever the stream has
+    if (mPassthrough) {
+        mAudioTgtChannels = 2;
+        mAudioTgtFreq = spdif_carrier_rate(mCtx->codec_id,
+                mAudioSrcFreq > 0 ? mAudioSrcFreq : 48000);
+        mAudioTgtFmt = AV_SAMPLE_FMT_S16;
+        mAudioTgtChannelLayout = AV_CH_LAYOUT_STEREO;
+    }
+
+    updateOutputBuffers();
+}
+
+int32_t SoftFFmpegAudio::getCodecFrameSize() {
+    if (mCtx->frame_size > 0) {
+        return mCtx->frame_size;
+    }
+
+    //samples per frame, not known before the decoder is opened
+    //unless the codec parameters came from the demuxer
+    switch (mMode) {
+    case MODE_AAC:
+        return 2048; //HE-AAC
+    case MODE_MPEG:
+    case MODE_MPEGL2:
+        return 1152;
+    case MODE_VORBIS:
+    case MODE_WMA:
+        return 2048;
+    case MODE_FLAC:
+        return 4608;
+    case MODE_AC3:
+        return 1536;
+    case MODE_APE:
+        return 73728;
+    case MODE_DTS:
+        return 2048;
+    default:
+        return 1024;
+    }
+}
+
+void SoftFFmpegAudio::updateOutputBuffers() {
+    OMX_PARAM_PORTDEFINITIONTYPE *def = &editPortInfo(kOutputPortIndex)->mDef;
+
+    if (def->bPopulated || mAudioTgtChannels <= 0 || mAudioTgtFreq <= 0
+            || mAudioTgtFmt == AV_SAMPLE_FMT_NONE) {
+        return;
+    }
+
+    int32_t frameBytes = mAudioTgtChannels * av_get_bytes_per_sample(mAudioTgtFmt);
+    int32_t srcFreq = mAudioSrcFreq > 0 ? mAudioSrcFreq : mAudioTgtFreq;
+    int64_t samples = av_rescale_rnd(getCodecFrameSize(),
+            mAudioTgtFreq, srcFreq, AV_ROUND_UP);
+    if (mLowPower) {
+        samples = FFMAX(samples,
+                av_rescale(kLowPowerBufferUs, mAudioTgtFreq, 1000000));
+    }
+
+    int64_t size = av_clip64(samples * frameBytes,
+            kOutputBufferSize, kMaxOutputBufferSize);
+    size -= size % frameBytes;
+
+    //small buffers need more of them to keep the sink fed
+    int64_t bufferUs = (size / frameBytes) * 1000000ll / mAudioTgtFreq;
+    int32_t count = kNumOutputBuffers;
+    while (count * bufferUs < kMinQueuedUs && count < kMaxOutputBuffers) {
+        count++;
+    }
+
+    def->nBufferSize = size;
+    def->nBufferCountActual = count;
+
+    ALOGD("output buffers: %d x %lld bytes (%lld us), low power: %d",
+            count, size, bufferUs, mLowPower);
 }
 
 OMX_ERRORTYPE SoftFFmpegAudio::internalSetParameter(
@@ -731,8 +992,52 @@ OMX_ERRORTYPE SoftFFmpegAudio::internalSetParameter(
                 return OMX_ErrorUndefined;
             }
 
-            mAudioTgtChannels = profile->nChannels;
-            mAudioTgtFreq = profile->nSamplingRate;
+            //the passthrough output is 16-bit stereo at the carrier rate,
+            //clients which set the track's pcm format anyway are ignored
+            //rather than failed, OMXCodec CHECKs the result
+            if (mPassthrough) {
+                if (profile->eNumData == OMX_NumericalDataFFmpegFloat
+                        || profile->nChannels != 2
+                        || (mAudioTgtFreq > 0
+                            && (int)profile->nSamplingRate != mAudioTgtFreq)) {
+                    ALOGW("passthrough, ignore OMX_IndexParamAudioPcm "
+                            "nChannels:%lu, nSampleRate:%lu, nBitsPerSample:%lu",
+                            profile->nChannels, profile->nSamplingRate,
+                            profile->nBitPerSample);
+                }
+                return OMX_ErrorNone;
+            }
+
+            if (profile->eNumData == OMX_NumericalDataFFmpegFloat) {
+                if (profile->nBitPerSample != 32) {
+                    return OMX_ErrorUnsupportedSetting;
+                }
+                mFloatOutput = true;
+            } else {
+                mFloatOutput = false;
+            }
+
+            enum AVSampleFormat fmt = mAudioTgtFmt;
+            if (fmt != AV_SAMPLE_FMT_NONE) {
+                fmt = mFloatOutput ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+            }
+            if ((int)profile->nChannels != mAudioTgtChannels
+                    || (int)profile->nSamplingRate != mAudioTgtFreq
+                    || fmt != mAudioTgtFmt) {
+                mAudioTgtChannels = profile->nChannels;
+                mAudioTgtFreq = profile->nSamplingRate;
+                mAudioTgtFmt = fmt;
+                mAudioTgtChannelLayout =
+                    av_get_default_channel_layout(mAudioTgtChannels);
+                //the converter is made for the old target, the next frame
+                //chooses between our kernels and a new one again
+                if (mSwrCtx) {
+                    swr_free(&mSwrCtx);
+                    mSwrCtx = NULL;
+                }
+                mLastFrameSamples = 0;
+            }
+            updateOutputBuffers();
 
             ALOGV("set OMX_IndexParamAudioPcm, nChannels:%lu, "
                     "nSampleRate:%lu, nBitsPerSample:%lu",
@@ -1027,12 +1332,138 @@ OMX_ERRORTYPE SoftFFmpegAudio::internalSetParameter(
             return OMX_ErrorNone;
         }
 
+        case OMX_IndexParamFFmpegCodecParams:
+        {
+            OMX_FFMPEG_PARAM_CODECPARAMSTYPE *codecParams =
+                (OMX_FFMPEG_PARAM_CODECPARAMSTYPE *)params;
+
+            if (codecParams->nPortIndex != kInputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            if (mCodecAlreadyOpened) {
+                return OMX_ErrorIncorrectStateOperation;
+            }
+
+            int32_t delay = 0, padding = 0;
+            status_t err = unpackCodecParams(mCtx,
+                    codecParams->nData, codecParams->nDataSize,
+                    &delay, &padding);
+            if (err != OK) {
+                ALOGW("ignore OMX_IndexParamFFmpegCodecParams (%d)", err);
+                return OMX_ErrorBadParameter;
+            }
+            mEncoderDelay = av_clip(delay, 0, kMaxEncoderDelay);
+            mEncoderPadding = av_clip(padding, 0, kMaxEncoderDelay);
+            mSkipSamples = mEncoderDelay;
+            //the extradata is complete, vorbis headers included, and
+            //the stream parameters replace whatever was set before
+            mExtradataReady = true;
+            mAudioSrcChannels = 0;
+            adjustAudioParams();
+
+            ALOGD("got OMX_IndexParamFFmpegCodecParams, codec: %s, "
+                    "channels: %d, sample_rate: %d, sample_fmt: %s, "
+                    "extradata size: %d, encoder delay: %d, padding: %d",
+                    avcodec_get_name(mCtx->codec_id),
+                    mCtx->channels, mCtx->sample_rate,
+                    av_get_sample_fmt_name(mCtx->sample_fmt),
+                    mCtx->extradata_size, mEncoderDelay, mEncoderPadding);
+
+            return OMX_ErrorNone;
+        }
+
+        case OMX_IndexParamFFmpegAudioOutputCaps:
+        {
+            const OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE *caps =
+                (const OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE *)params;
+
+            if (caps->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            if (mCodecAlreadyOpened) {
+                return OMX_ErrorIncorrectStateOperation;
+            }
+
+            if (caps->nMaxChannels < 1 || caps->nMaxSampleRate < 4000) {
+                return OMX_ErrorBadParameter;
+            }
+
+            mMaxOutputChannels = FFMIN(caps->nMaxChannels, (OMX_U32)kMaxChannels);
+            mMaxOutputFreq = FFMIN(caps->nMaxSampleRate, (OMX_U32)kMaxSampleRate);
+
+            //the input format came first, work out the output again
+            if (isConfigured()) {
+                mAudioSrcChannels = 0;
+                mAudioTgtChannels = 0;
+                mAudioTgtFreq = 0;
+                adjustAudioParams();
+            }
+
+            ALOGD("set OMX_IndexParamFFmpegAudioOutputCaps, max channels: %d, "
+                    "max sample rate: %d", mMaxOutputChannels, mMaxOutputFreq);
+
+            return OMX_ErrorNone;
+        }
+
+        case OMX_IndexParamFFmpegAudioPassthrough:
+        {
+            const OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE *passthrough =
+                (const OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE *)params;
+
+            if (passthrough->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            if (!spdif_packer_supported(mCtx->codec_id)) {
+                return OMX_ErrorUnsupportedSetting;
+            }
+
+            if (mCodecAlreadyOpened || mSpdif) {
+                return OMX_ErrorIncorrectStateOperation;
+            }
+
+            mPassthrough = passthrough->bEnable == OMX_TRUE;
+
+            //the input format came first, work out the output again
+            if (isConfigured()) {
+                mAudioSrcChannels = 0;
+                mAudioTgtChannels = 0;
+                mAudioTgtFreq = 0;
+                adjustAudioParams();
+            }
+
+            ALOGD("set OMX_IndexParamFFmpegAudioPassthrough, enable: %d",
+                    mPassthrough);
+
+            return OMX_ErrorNone;
+        }
+
         default:
 
             return SimpleSoftOMXComponent::internalSetParameter(index, params);
     }
 }
 
+OMX_ERRORTYPE SoftFFmpegAudio::getExtensionIndex(
+        const char *name, OMX_INDEXTYPE *index) {
+    if (!strcmp(name, FFMPEG_OMX_INDEX_CODEC_PARAMS)) {
+        *index = (OMX_INDEXTYPE)OMX_IndexParamFFmpegCodecParams;
+        return OMX_ErrorNone;
+    }
+    if (!strcmp(name, FFMPEG_OMX_INDEX_AUDIO_OUTPUT_CAPS)) {
+        *index = (OMX_INDEXTYPE)OMX_IndexParamFFmpegAudioOutputCaps;
+        return OMX_ErrorNone;
+    }
+    if (!strcmp(name, FFMPEG_OMX_INDEX_AUDIO_PASSTHROUGH)) {
+        *index = (OMX_INDEXTYPE)OMX_IndexParamFFmpegAudioPassthrough;
+        return OMX_ErrorNone;
+    }
+
+    return SimpleSoftOMXComponent::getExtensionIndex(name, index);
+}
+
 int32_t SoftFFmpegAudio::handleVorbisExtradata(OMX_BUFFERHEADERTYPE *inHeader)
 {
     uint8_t *p = inHeader->pBuffer + inHeader->nOffset;
@@ -1143,7 +1574,8 @@ int32_t SoftFFmpegAudio::openDecoder() {
            mCtx->sample_rate, mCtx->channels,
            av_get_sample_fmt_name(mCtx->sample_fmt));
 
-    int err = avcodec_open2(mCtx, mCtx->codec, NULL);
+    //may hand back a warm decoder of the same stream
+    int err = codec_pool_open(&mCtx, mCtx->codec, 0);
     if (err < 0) {
         ALOGE("ffmpeg audio decoder failed to initialize.(%s)", av_err2str(err));
         return ERR_DECODER_OPEN_FAILED;
@@ -1162,6 +1594,8 @@ int32_t SoftFFmpegAudio::openDecoder() {
         return ERR_OOM;
     }
 
+    startDecodeWorkers();
+
 	return ERR_OK;
 }
 
@@ -1177,6 +1611,64 @@ void SoftFFmpegAudio::updateTimeStamp(OMX_BUFFERHEADERTYPE *inHeader) {
     if (inHeader->nTimeStamp != AV_NOPTS_VALUE) {
         mAudioClock = inHeader->nTimeStamp;
     }
+
+    updateSkipSamples(inHeader->nTimeStamp);
+}
+
+//the encoder delay is only in front of the first packet, not in front
+//of one sought to
+void SoftFFmpegAudio::updateSkipSamples(int64_t timeUs) {
+    if (!mCheckSkip) {
+        return;
+    }
+    mCheckSkip = false;
+
+    if (timeUs != AV_NOPTS_VALUE && timeUs > 0) {
+        mSkipSamples = 0;
+    }
+}
+
+//drop what is left of the encoder delay from the front of the converted
+//frame, the data stays where it is. the audio clock isn't advanced, the
+//first sample which is played has the timestamp of the first packet.
+void SoftFFmpegAudio::trimEncoderDelay() {
+    if (mSkipSamples <= 0 || mResampledDataSize <= 0) {
+        return;
+    }
+
+    if (mSkipSamples >= mFrame->nb_samples) {
+        mSkipSamples -= mFrame->nb_samples;
+        mResampledData += mResampledDataSize;
+        mResampledDataSize = 0;
+        return;
+    }
+
+    int32_t frameBytes = mAudioTgtChannels * av_get_bytes_per_sample(mAudioTgtFmt);
+    int32_t srcFreq = mFrame->sample_rate > 0 ? mFrame->sample_rate : mAudioTgtFreq;
+    int32_t skip = av_rescale(mSkipSamples, mAudioTgtFreq, srcFreq) * frameBytes;
+    skip = FFMIN(skip, mResampledDataSize);
+    mResampledData += skip;
+    mResampledDataSize -= skip;
+    mSkipSamples = 0;
+}
+
+//the encoder padding at the output format, 0 if it is not cut. it is kept
+//back in all output buffers but two at most.
+int32_t SoftFFmpegAudio::getPaddingBytes() {
+    if (mEncoderPadding <= 0 || mPassthrough || mAudioTgtFreq <= 0
+            || mAudioTgtFmt == AV_SAMPLE_FMT_NONE) {
+        return 0;
+    }
+
+    const OMX_PARAM_PORTDEFINITIONTYPE *def = &editPortInfo(kOutputPortIndex)->mDef;
+    int32_t frameBytes = mAudioTgtChannels * av_get_bytes_per_sample(mAudioTgtFmt);
+    int32_t srcFreq = mAudioSrcFreq > 0 ? mAudioSrcFreq : mAudioTgtFreq;
+    int64_t bytes = av_rescale_rnd(mEncoderPadding, mAudioTgtFreq, srcFreq,
+            AV_ROUND_UP) * frameBytes;
+    if (bytes > (int64_t)def->nBufferSize * ((int64_t)def->nBufferCountActual - 2)) {
+        return 0;
+    }
+    return bytes;
 }
 
 void SoftFFmpegAudio::initPacket(AVPacket *pkt,
@@ -1204,6 +1696,566 @@ void SoftFFmpegAudio::initPacket(AVPacket *pkt,
 #endif
 }
 
+bool SoftFFmpegAudio::initPassthrough() {
+    if (mSpdif) {
+        return true;
+    }
+
+    mSpdif = spdif_packer_open(mCtx->codec_id);
+    mParser = mSpdif ? av_parser_init(mCtx->codec_id) : NULL;
+    if (!mSpdif || !mParser) {
+        //the output is 16-bit stereo at the stream's rate, which the
+        //decoder can give as well
+        ALOGW("no passthrough for %s, decoding instead",
+                avcodec_get_name(mCtx->codec_id));
+        deinitPassthrough();
+        mPassthrough = false;
+        return false;
+    }
+
+    ALOGI("%s passthrough, IEC 61937 at %d Hz",
+            avcodec_get_name(mCtx->codec_id), mAudioTgtFreq);
+    return true;
+}
+
+void SoftFFmpegAudio::deinitPassthrough() {
+    if (mParser) {
+        av_parser_close(mParser);
+        mParser = NULL;
+    }
+    spdif_packer_close(&mSpdif);
+}
+
+//split the input into frames and pack each into a burst, the counterpart
+//of decodeAudio(). a flush returns what the parser still holds.
+int32_t SoftFFmpegAudio::passthroughAudio() {
+	bool is_flush = (mEOSStatus != INPUT_DATA_AVAILABLE);
+    List<BufferInfo *> &inQueue = getPortQueue(kInputPortIndex);
+    BufferInfo *inInfo = NULL;
+    OMX_BUFFERHEADERTYPE *inHeader = NULL;
+    const uint8_t *data = NULL;
+    int size = 0;
+
+    CHECK_EQ(mResampledDataSize, 0);
+
+    if (mParser == NULL) {
+        return is_flush ? ERR_FLUSHED : ERR_NO_FRM;
+    }
+
+    if (!is_flush) {
+        inInfo = *inQueue.begin();
+        CHECK(inInfo != NULL);
+        inHeader = inInfo->mHeader;
+
+		if (mInputBufferSize == 0) {
+		    updateTimeStamp(inHeader);
+            mInputBufferSize = inHeader->nFilledLen;
+        }
+        data = inHeader->pBuffer + inHeader->nOffset;
+        size = inHeader->nFilledLen;
+    }
+
+    do {
+        uint8_t *frame = NULL;
+        int frameSize = 0;
+        int len = av_parser_parse2(mParser, mCtx, &frame, &frameSize,
+                data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+
+        if (!is_flush) {
+            CHECK_GE(inHeader->nFilledLen, len);
+            inHeader->nOffset += len;
+            inHeader->nFilledLen -= len;
+            mInputBufferSize -= len;
+
+            if (inHeader->nFilledLen == 0) {
+                CHECK_EQ(mInputBufferSize, 0);
+                inQueue.erase(inQueue.begin());
+                inInfo->mOwnedByUs = false;
+                notifyEmptyBufferDone(inHeader);
+            }
+        }
+
+        if (frameSize == 0) {
+            return is_flush ? ERR_FLUSHED : ERR_NO_FRM;
+        }
+
+        const uint8_t *burst = NULL;
+        int burstSize = 0;
+        int err = spdif_packer_pack(mSpdif, frame, frameSize, &burst, &burstSize);
+        if (err < 0) {
+            ALOGW("failed to pack a %s frame of %d bytes (%s), skip it",
+                    avcodec_get_name(mCtx->codec_id), frameSize, av_err2str(err));
+        } else if (burstSize > 0) {
+#if DEBUG_SPDIF
+            //compare with "ffmpeg -i <file> -c copy -f spdif <ref>"
+            FILE *fp = fopen("/data/local/tmp/spdif.raw", "ab");
+            if (fp) {
+                fwrite(burst, 1, burstSize, fp);
+                fclose(fp);
+            }
+#endif
+            //valid until the next frame is packed, which is after
+            //this burst has been drained
+            mResampledData = (uint8_t *)burst;
+            mResampledDataSize = burstSize;
+            return ERR_OK;
+        }
+    } while (is_flush);
+
+    return ERR_NO_FRM;
+}
+
+//where the next output comes from: the spdif packer, the decode workers
+//or the decoder on this thread
+int32_t SoftFFmpegAudio::decodeNextAudio() {
+    if (mPassthrough) {
+        return passthroughAudio();
+    }
+    if (mNumDecodeWorkers > 0) {
+        return decodeAudioParallel();
+    }
+    return decodeAudio();
+}
+
+//each packet decodes on its own, nothing is carried over from the one
+//before. not WMA Lossless, whose frames span packets.
+bool SoftFFmpegAudio::isFrameIndependent() {
+    switch (mCtx->codec_id) {
+    case AV_CODEC_ID_FLAC:
+    case AV_CODEC_ID_APE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void SoftFFmpegAudio::startDecodeWorkers() {
+    char value[PROPERTY_VALUE_MAX];
+    int threads;
+
+    if (mNumDecodeWorkers > 0) {
+        return;
+    }
+
+    if (isFrameIndependent()) {
+        //setprop sys.media.adec.threads 1 decodes on the OMX thread only,
+        //unless decoding ahead
+        property_get("sys.media.adec.threads", value, "0");
+        threads = atoi(value);
+        if (threads <= 0) {
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        threads = threads > kMaxDecodeWorkers ? kMaxDecodeWorkers : threads;
+        if (threads <= 1 && mDecodeAheadUs <= 0) {
+            return;
+        }
+        threads = threads < 1 ? 1 : threads;
+    } else if (mDecodeAheadUs > 0) {
+        //the packets have to go through one context in order
+        threads = 1;
+    } else {
+        return;
+    }
+
+    mStopDecode = false;
+    mDecodeWorkersRunning = 0;
+    mDecodeUnderruns = 0;
+    mDecodeStarved = true;
+    mLevelMinUs = 0;
+    mLevelSumUs = 0;
+    mLevelSpanUs = 0;
+
+    for (int i = 0; i < threads; i++) {
+        AVCodecContext *avctx = avcodec_alloc_context3(mCtx->codec);
+        if (!avctx) {
+            break;
+        }
+        //same parameters and extradata as mCtx, opened on its own. its
+        //frames outlive the next decode call, they must own their data.
+        if (avcodec_copy_context(avctx, mCtx) < 0) {
+            ALOGE("failed to copy the context of decode worker %d", i);
+            codec_pool_free_context(&avctx);
+            break;
+        }
+        avctx->refcounted_frames = 1;
+        if (avcodec_open2(avctx, mCtx->codec, NULL) < 0) {
+            ALOGE("failed to open the context of decode worker %d", i);
+            codec_pool_free_context(&avctx);
+            break;
+        }
+        mWorkerCtx[i] = avctx;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+        int err = pthread_create(&mDecodeWorkers[i], &attr,
+                DecodeWorkerWrapper, this);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            codec_pool_free_context(&mWorkerCtx[i]);
+            break;
+        }
+        mNumDecodeWorkers++;
+    }
+
+    ALOGI("%s: %d decode workers, %lld ms decoded ahead", mCtx->codec->name,
+            mNumDecodeWorkers, mDecodeAheadUs / 1000);
+}
+
+void SoftFFmpegAudio::stopDecodeWorkers() {
+    if (mNumDecodeWorkers == 0) {
+        return;
+    }
+
+    mDecodeLock.lock();
+    mStopDecode = true;
+    mDecodeCond.broadcast();
+    mDecodeLock.unlock();
+
+    for (int i = 0; i < mNumDecodeWorkers; i++) {
+        void *dummy;
+        pthread_join(mDecodeWorkers[i], &dummy);
+        codec_pool_free_context(&mWorkerCtx[i]);
+    }
+    mNumDecodeWorkers = 0;
+
+    Mutex::Autolock autoLock(mDecodeLock);
+    clearDecodeJobs();
+    if (mDecodeAheadUs > 0 && mLevelSpanUs > 0) {
+        ALOGD("decode workers stopped, %d underruns, %lld ms decoded ahead "
+                "on average, %lld ms at least", mDecodeUnderruns,
+                mLevelSumUs / mLevelSpanUs / 1000, mLevelMinUs / 1000);
+    } else {
+        ALOGD("decode workers stopped, %d underruns", mDecodeUnderruns);
+    }
+}
+
+//wait for the packets in decoding, then drop all of them
+void SoftFFmpegAudio::flushDecodeWorkers() {
+    if (mNumDecodeWorkers == 0) {
+        return;
+    }
+
+    Mutex::Autolock autoLock(mDecodeLock);
+    for (List<DecodeJob *>::iterator it = mDecodeJobs.begin();
+            it != mDecodeJobs.end(); ) {
+        if ((*it)->busy) {
+            mReadyCond.wait(mDecodeLock);
+            it = mDecodeJobs.begin();
+        } else {
+            ++it;
+        }
+    }
+    clearDecodeJobs();
+    mDecodeDrainQueued = false;
+    mDecodeStarved = true;
+
+    for (int i = 0; i < mNumDecodeWorkers; i++) {
+        avcodec_flush_buffers(mWorkerCtx[i]);
+    }
+}
+
+//called with mDecodeLock held, no job busy
+void SoftFFmpegAudio::clearDecodeJobs() {
+    for (List<DecodeJob *>::iterator it = mDecodeJobs.begin();
+            it != mDecodeJobs.end(); ++it) {
+        DecodeJob *job = *it;
+        for (List<AVFrame *>::iterator f = job->frames.begin();
+                f != job->frames.end(); ++f) {
+            av_frame_free(&(*f));
+        }
+        av_free_packet(&job->pkt);
+        delete job;
+    }
+    mDecodeJobs.clear();
+    mDecodedUs = 0;
+}
+
+//called with mDecodeLock held. no more packets are queued while as many
+//as the workers may take are waiting, or in decode-ahead mode while
+//mDecodeAheadUs is ready.
+bool SoftFFmpegAudio::isDecodeAheadFull() {
+    size_t maxJobs = mNumDecodeWorkers * kMaxDecodeJobsPerWorker;
+
+    if (mDecodeAheadUs <= 0) {
+        return mDecodeJobs.size() >= maxJobs;
+    }
+
+    size_t pending = 0;
+    for (List<DecodeJob *>::iterator it = mDecodeJobs.begin();
+            it != mDecodeJobs.end(); ++it) {
+        if (!(*it)->done) {
+            pending++;
+        }
+    }
+    return pending >= maxJobs || mDecodedUs >= mDecodeAheadUs;
+}
+
+//called with mDecodeLock held, a frame of frameUs is taken off the jobs
+void SoftFFmpegAudio::updateDecodeLevel(int64_t frameUs) {
+    mDecodedUs -= frameUs;
+    mDecodeStarved = false;
+
+    if (mLevelSpanUs == 0 || mDecodedUs < mLevelMinUs) {
+        mLevelMinUs = mDecodedUs;
+    }
+    mLevelSumUs += mDecodedUs * frameUs;
+    mLevelSpanUs += frameUs;
+
+#if DEBUG_AHEAD
+    if (mLevelSpanUs / 10000000LL != (mLevelSpanUs - frameUs) / 10000000LL) {
+        ALOGI("%s: %lld ms decoded ahead on average, %lld ms at least, "
+                "%d underruns so far", mCtx->codec->name,
+                mLevelSumUs / mLevelSpanUs / 1000, mLevelMinUs / 1000,
+                mDecodeUnderruns);
+    }
+#endif
+}
+
+// static
+void *SoftFFmpegAudio::DecodeWorkerWrapper(void *me) {
+    ((SoftFFmpegAudio *)me)->decodeWorkerEntry();
+
+    return NULL;
+}
+
+void SoftFFmpegAudio::decodeWorkerEntry() {
+    androidSetThreadPriority(0, ANDROID_PRIORITY_AUDIO);
+
+    mDecodeLock.lock();
+    AVCodecContext *avctx = mWorkerCtx[mDecodeWorkersRunning++];
+    while (!mStopDecode) {
+        DecodeJob *job = NULL;
+        for (List<DecodeJob *>::iterator it = mDecodeJobs.begin();
+                it != mDecodeJobs.end(); ++it) {
+            if (!(*it)->busy && !(*it)->done) {
+                job = *it;
+                break;
+            }
+        }
+        if (job == NULL) {
+            mDecodeCond.wait(mDecodeLock);
+            continue;
+        }
+
+        job->busy = true;
+        mDecodeLock.unlock();
+
+        decodeJob(avctx, job);
+
+        mDecodeLock.lock();
+        job->busy = false;
+        job->done = true;
+        mDecodedUs += job->durationUs;
+        mReadyCond.signal();
+    }
+    mDecodeLock.unlock();
+}
+
+static int64_t getFrameDurationUs(const AVFrame *frame) {
+    if (frame->sample_rate <= 0) {
+        return 0;
+    }
+    return frame->nb_samples * 1000000LL / frame->sample_rate;
+}
+
+//all frames of one packet, an APE packet gives several. an empty packet
+//takes what the decoder holds back.
+void SoftFFmpegAudio::decodeJob(AVCodecContext *avctx, DecodeJob *job) {
+    AVPacket pkt = job->pkt;
+    bool drain = (pkt.size == 0);
+
+    while (pkt.size > 0 || drain) {
+        int gotFrm = 0;
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            ALOGE("oom for audio frame");
+            job->failed = true;
+            break;
+        }
+
+        int len = avcodec_decode_audio4(avctx, frame, &gotFrm, &pkt);
+        if (len < 0) {
+            av_frame_free(&frame);
+            job->failed = true;
+            break;
+        }
+
+        if (gotFrm) {
+            job->durationUs += getFrameDurationUs(frame);
+            job->frames.push_back(frame);
+        } else {
+            av_frame_free(&frame);
+            if (drain || len == 0) {
+                break;
+            }
+        }
+
+        pkt.data += len;
+        pkt.size -= len;
+    }
+}
+
+//copy the input buffers into packets for the workers and hand them back
+//right away, as far ahead of the output as isDecodeAheadFull() lets us
+int32_t SoftFFmpegAudio::queueDecodeJobs() {
+    List<BufferInfo *> &inQueue = getPortQueue(kInputPortIndex);
+    bool queued = false;
+
+    while (!inQueue.empty()) {
+        BufferInfo *inInfo = *inQueue.begin();
+        OMX_BUFFERHEADERTYPE *inHeader = inInfo->mHeader;
+
+        //left to onQueueFilled()
+        if (inHeader->nFlags & (OMX_BUFFERFLAG_EOS | OMX_BUFFERFLAG_CODECCONFIG)) {
+            break;
+        }
+
+        {
+            Mutex::Autolock autoLock(mDecodeLock);
+            if (isDecodeAheadFull()) {
+                break;
+            }
+        }
+
+        DecodeJob *job = new DecodeJob;
+        if (av_new_packet(&job->pkt, inHeader->nFilledLen) < 0) {
+            ALOGE("oom for audio packet");
+            delete job;
+            return ERR_OOM;
+        }
+        memcpy(job->pkt.data, inHeader->pBuffer + inHeader->nOffset,
+                inHeader->nFilledLen);
+        job->timeUs = inHeader->nTimeStamp == SF_NOPTS_VALUE ?
+                AV_NOPTS_VALUE : inHeader->nTimeStamp;
+
+        mDecodeLock.lock();
+        mDecodeJobs.push_back(job);
+        mDecodeLock.unlock();
+        queued = true;
+
+        inQueue.erase(inQueue.begin());
+        inInfo->mOwnedByUs = false;
+        notifyEmptyBufferDone(inHeader);
+    }
+
+    if (queued) {
+        Mutex::Autolock autoLock(mDecodeLock);
+        mDecodeCond.broadcast();
+    }
+
+    return ERR_OK;
+}
+
+//the next frame in input order. the workers are waited for only if they
+//are as far ahead as they may be, or at eos, otherwise the next input
+//buffer or output buffer brings us back.
+int32_t SoftFFmpegAudio::decodeAudioParallel() {
+	bool is_flush = (mEOSStatus != INPUT_DATA_AVAILABLE);
+    DecodeJob *job = NULL;
+    AVFrame *frame = NULL;
+
+    CHECK_EQ(mResampledDataSize, 0);
+
+    if (!is_flush) {
+        int32_t err = queueDecodeJobs();
+        if (err != ERR_OK) {
+            return err;
+        }
+    } else if (!mDecodeDrainQueued) {
+        //a single worker decodes all packets in one context, which may
+        //hold samples back until it gets an empty packet
+        mDecodeDrainQueued = true;
+        if (mNumDecodeWorkers == 1
+                && (mCtx->codec->capabilities & CODEC_CAP_DELAY)) {
+            Mutex::Autolock autoLock(mDecodeLock);
+            mDecodeJobs.push_back(new DecodeJob);
+            mDecodeCond.broadcast();
+        }
+    }
+
+    mDecodeLock.lock();
+    for (;;) {
+        if (mDecodeJobs.empty()) {
+            mDecodeLock.unlock();
+            return is_flush ? ERR_FLUSHED : ERR_NO_FRM;
+        }
+
+        job = *mDecodeJobs.begin();
+        if (!job->done) {
+            //nothing decoded is left while there is output to fill, not
+            //counted before the first frame
+            if (!is_flush && !mDecodeStarved) {
+                mDecodeStarved = true;
+                mDecodeUnderruns++;
+#if DEBUG_AHEAD
+                ALOGI("underrun of the decode workers, %d jobs queued",
+                        (int)mDecodeJobs.size());
+#endif
+            }
+            if (!is_flush && !isDecodeAheadFull()) {
+                mDecodeLock.unlock();
+                return ERR_NO_FRM;
+            }
+            mReadyCond.wait(mDecodeLock);
+            continue;
+        }
+
+        if (!job->frames.empty() || job->failed) {
+            break;
+        }
+
+        //all of this packet is out
+        mDecodeJobs.erase(mDecodeJobs.begin());
+        av_free_packet(&job->pkt);
+        delete job;
+    }
+
+    //the workers are done with the job and only this thread removes it
+    if (!job->frames.empty()) {
+        frame = *job->frames.begin();
+        job->frames.erase(job->frames.begin());
+        updateDecodeLevel(getFrameDurationUs(frame));
+    }
+    mDecodeLock.unlock();
+
+    //the input buffer's timestamp goes first, as in updateTimeStamp()
+    updateSkipSamples(job->timeUs);
+    if (job->timeUs != AV_NOPTS_VALUE) {
+        mAudioClock = job->timeUs;
+        job->timeUs = AV_NOPTS_VALUE;
+    }
+
+    if (frame == NULL) {
+        ALOGW("ffmpeg audio decoder err, we skip the frame and play silence instead");
+        job->failed = false;
+        return playSilence();
+    }
+
+    av_frame_unref(mFrame);
+    av_frame_move_ref(mFrame, frame);
+    av_frame_free(&frame);
+
+    int32_t err = resampleAudio();
+    bool inFrame = (mResampledData == mFrame->data[0]);
+    if (err == ERR_OK) {
+        trimEncoderDelay();
+    }
+    //the worker's frame goes unless it is the output itself
+    if (!inFrame) {
+        av_frame_unref(mFrame);
+    }
+    return err;
+}
+
+#if DEBUG_CPU
+static int64_t getThreadCpuTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+#endif
+
 int32_t SoftFFmpegAudio::decodeAudio() {
     int len = 0;
     int gotFrm = false;
@@ -1232,13 +2284,14 @@ int32_t SoftFFmpegAudio::decodeAudio() {
     av_frame_unref(mFrame);
     avcodec_get_frame_defaults(mFrame);
 
+#if DEBUG_CPU
+    int64_t startUs = getThreadCpuTimeUs();
+#endif
     len = avcodec_decode_audio4(mCtx, mFrame, &gotFrm, &pkt);
     //a negative error code is returned if an error occurred during decoding
     if (len < 0) {
         ALOGW("ffmpeg audio decoder err, we skip the frame and play silence instead");
-        mResampledData = mSilenceBuffer;
-        mResampledDataSize = kOutputBufferSize;
-        ret = ERR_OK;
+        ret = playSilence();
     } else {
 #if DEBUG_PKT
         ALOGV("ffmpeg audio decoder, consume pkt len: %d", len);
@@ -1256,6 +2309,12 @@ int32_t SoftFFmpegAudio::decodeAudio() {
 		    }
         } else {
             ret = resampleAudio();
+            if (ret == ERR_OK) {
+                trimEncoderDelay();
+            }
+#if DEBUG_CPU
+            updateCpuStats(getThreadCpuTimeUs() - startUs);
+#endif
 		}
     }
 
@@ -1283,6 +2342,157 @@ int32_t SoftFFmpegAudio::decodeAudio() {
     return ret;
 }
 
+uint8_t *SoftFFmpegAudio::getAudioBuffer(int size) {
+    //whatever was left of the last frame is dropped by now
+    av_buffer_unref(&mAudioBuffer);
+
+    Mutex::Autolock autoLock(sAudioPoolLock);
+    if (sAudioPool == NULL || sAudioPoolSize < size) {
+        //round up, the frame size of most codecs hardly changes. buffers
+        //of the old pool stay valid, it is freed once they are returned.
+        size = FFALIGN(size, 4096);
+        av_buffer_pool_uninit(&sAudioPool);
+        sAudioPool = av_buffer_pool_init(size, NULL);
+        sAudioPoolSize = sAudioPool ? size : 0;
+#if DEBUG_MEM
+        ALOGI("shared resample buffers grow to %d bytes", size);
+#endif
+    }
+
+    mAudioBuffer = sAudioPool ? av_buffer_pool_get(sAudioPool) : NULL;
+    return mAudioBuffer ? mAudioBuffer->data : NULL;
+}
+
+//cpu time for decoding plus conversion, per second of audio
+void SoftFFmpegAudio::updateCpuStats(int64_t cpuUs) {
+    mCpuUs += cpuUs;
+    mCpuSamples += mFrame->nb_samples;
+    mDecodedFrames++;
+
+    if (mCpuSamples >= 10LL * mFrame->sample_rate) {
+        ALOGI("%s: %lld us cpu per second decoded, %lld of %lld frames converted",
+                mCtx->codec->name,
+                mCpuUs * mFrame->sample_rate / mCpuSamples,
+                mConvertedFrames, mDecodedFrames);
+        mCpuUs = 0;
+        mCpuSamples = 0;
+    }
+}
+
+//planar float or 32-bit at the output layout, or 5.1 float downmixed
+//to stereo, all at the output rate: the bulk of what the decoders give.
+//for float output planar float is only interleaved.
+bool SoftFFmpegAudio::convertAudio(int64_t channelLayout) {
+    bool sameLayout = channelLayout == mAudioTgtChannelLayout;
+    bool downmix = (channelLayout == AV_CH_LAYOUT_5POINT1
+                    || channelLayout == AV_CH_LAYOUT_5POINT1_BACK)
+            && mAudioTgtChannelLayout == AV_CH_LAYOUT_STEREO;
+
+    if (mFrame->sample_rate != mAudioTgtFreq) {
+        return false;
+    }
+    if (mAudioTgtFmt == AV_SAMPLE_FMT_FLT) {
+        //float output only interleaves
+        if (mFrame->format != AV_SAMPLE_FMT_FLTP || !sameLayout) {
+            return false;
+        }
+    } else if (mAudioTgtFmt != AV_SAMPLE_FMT_S16) {
+        return false;
+    } else if (mFrame->format == AV_SAMPLE_FMT_FLTP) {
+        if (!sameLayout && !downmix) {
+            return false;
+        }
+    } else if (mFrame->format != AV_SAMPLE_FMT_S32P || !sameLayout) {
+        return false;
+    }
+
+    int size = mFrame->nb_samples * mAudioTgtChannels
+            * av_get_bytes_per_sample(mAudioTgtFmt);
+    uint8_t *dst = getAudioBuffer(size);
+    if (dst == NULL) {
+        return false;
+    }
+
+#if DEBUG_KERNELS
+    int64_t startUs = ALooper::GetNowUs();
+#endif
+    if (mAudioTgtFmt == AV_SAMPLE_FMT_FLT) {
+        fltp_to_flt((float *)dst, (const float * const *)mFrame->extended_data,
+                mAudioTgtChannels, mFrame->nb_samples);
+    } else if (mFrame->format == AV_SAMPLE_FMT_S32P) {
+        s32p_to_s16((int16_t *)dst, (const int32_t * const *)mFrame->extended_data,
+                mAudioTgtChannels, mFrame->nb_samples);
+    } else if (sameLayout) {
+        fltp_to_s16((int16_t *)dst, (const float * const *)mFrame->extended_data,
+                mAudioTgtChannels, mFrame->nb_samples);
+    } else {
+        fltp_51_to_s16_stereo((int16_t *)dst, (const float * const *)mFrame->extended_data,
+                mFrame->nb_samples);
+    }
+
+    mResampledData = dst;
+    mResampledDataSize = size;
+
+#if DEBUG_KERNELS
+    checkAudioKernel(channelLayout, ALooper::GetNowUs() - startUs);
+#endif
+    return true;
+}
+
+//convert the frame once more with swresample, compare and time both
+void SoftFFmpegAudio::checkAudioKernel(int64_t channelLayout, int64_t kernelUs) {
+    static int64_t sKernelUs, sSwrUs, sFrames, sMismatches;
+    struct SwrContext *swr = swr_alloc_set_opts(NULL,
+            mAudioTgtChannelLayout, mAudioTgtFmt, mAudioTgtFreq,
+            channelLayout, (enum AVSampleFormat)mFrame->format, mFrame->sample_rate,
+            0, NULL);
+    uint8_t *out = (uint8_t *)av_malloc(mResampledDataSize);
+
+    if (swr && out && swr_init(swr) >= 0) {
+        int64_t startUs = ALooper::GetNowUs();
+        int len = swr_convert(swr, &out, mFrame->nb_samples,
+                (const uint8_t **)mFrame->extended_data, mFrame->nb_samples);
+        sSwrUs += ALooper::GetNowUs() - startUs;
+        sKernelUs += kernelUs;
+
+        if (len != mFrame->nb_samples
+                || memcmp(out, mResampledData, mResampledDataSize)) {
+            sMismatches++;
+        }
+        if (++sFrames % 500 == 0) {
+            ALOGI("%s kernels, %s %d channels: %lld/%lld frames differ "
+                    "from swresample, %lld us against %lld us",
+                    audio_kernels_name(),
+                    av_get_sample_fmt_name((enum AVSampleFormat)mFrame->format),
+                    av_frame_get_channels(mFrame), sMismatches, sFrames,
+                    sKernelUs, sSwrUs);
+        }
+    }
+
+    av_free(out);
+    swr_free(&swr);
+}
+
+//whole frames of silence at the output format, as long as the last
+//frame or a codec frame before the first one
+int32_t SoftFFmpegAudio::playSilence() {
+    int32_t samples = mLastFrameSamples > 0 ? mLastFrameSamples
+            : getCodecFrameSize();
+    int32_t size = samples * mAudioTgtChannels
+            * av_get_bytes_per_sample(mAudioTgtFmt);
+    uint8_t *dst = getAudioBuffer(size);
+
+    if (dst == NULL) {
+        ALOGE("no buffer for %d bytes of silence", size);
+        return ERR_OOM;
+    }
+    memset(dst, 0, size);
+
+    mResampledData = dst;
+    mResampledDataSize = size;
+    return ERR_OK;
+}
+
 int32_t SoftFFmpegAudio::resampleAudio() {
 	int channels = 0;
     int64_t channelLayout = 0;
@@ -1296,12 +2506,61 @@ int32_t SoftFFmpegAudio::resampleAudio() {
             mFrame->nb_samples, dataSize);
 #endif
 
+    if (mFrame->sample_rate > 0) {
+        mLastFrameSamples = av_rescale(mFrame->nb_samples,
+                mAudioTgtFreq, mFrame->sample_rate);
+    }
+
 	channels = av_get_channel_layout_nb_channels(mFrame->channel_layout);
     channelLayout =
         (mFrame->channel_layout && av_frame_get_channels(mFrame) == channels) ?
         mFrame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(mFrame));
 
-    if (mFrame->format != mAudioSrcFmt
+    //multichannel output keeps the source's own layout, e.g. side or
+    //back surround, rather than remixing into the default one
+    if (mAudioTgtChannels > 2 && channelLayout != mAudioTgtChannelLayout
+            && av_frame_get_channels(mFrame) == mAudioTgtChannels) {
+        ALOGI("output channel layout 0x%llx, was 0x%llx",
+                channelLayout, mAudioTgtChannelLayout);
+        mAudioTgtChannelLayout = channelLayout;
+        if (mSwrCtx) {
+            swr_free(&mSwrCtx);
+            mSwrCtx = NULL;
+        }
+    }
+
+    //the decoder gives us what we output, no conversion needed
+    if (mFrame->format == mAudioTgtFmt
+            && channelLayout == mAudioTgtChannelLayout
+            && mFrame->sample_rate == mAudioTgtFreq) {
+        if (mSwrCtx) {
+            ALOGI("decoder output matches the output format, stop converting");
+            swr_free(&mSwrCtx);
+            mSwrCtx = NULL;
+        }
+        mAudioSrcChannelLayout = channelLayout;
+        mAudioSrcChannels = av_frame_get_channels(mFrame);
+        mAudioSrcFreq = mFrame->sample_rate;
+        mAudioSrcFmt = (enum AVSampleFormat)mFrame->format;
+
+        mResampledData = mFrame->data[0];
+        mResampledDataSize = dataSize;
+
+#if DEBUG_FRM
+        ALOGV("ffmpeg audio decoder(no resample),"
+                "nb_samples(before resample):%d, mResampledDataSize:%d",
+                mFrame->nb_samples, mResampledDataSize);
+#endif
+        return ERR_OK;
+    }
+
+    if (mAudioKernels && convertAudio(channelLayout)) {
+        mConvertedFrames++;
+        return ERR_OK;
+    }
+
+    if (mSwrCtx == NULL
+            || mFrame->format != mAudioSrcFmt
             || channelLayout != mAudioSrcChannelLayout
             || mFrame->sample_rate != mAudioSrcFreq) {
         if (mSwrCtx) {
@@ -1349,8 +2608,11 @@ int32_t SoftFFmpegAudio::resampleAudio() {
 
     if (mSwrCtx) {
         const uint8_t **in = (const uint8_t **)mFrame->extended_data;
-        uint8_t *out[] = {mAudioBuffer};
-        int out_count = sizeof(mAudioBuffer) / mAudioTgtChannels / av_get_bytes_per_sample(mAudioTgtFmt);
+        //what the resampler holds back plus this frame, at the target
+        //rate, with some headroom as ffplay does
+        int out_count = av_rescale_rnd(
+                swr_get_delay(mSwrCtx, mFrame->sample_rate) + mFrame->nb_samples,
+                mAudioTgtFreq, mFrame->sample_rate, AV_ROUND_UP) + 256;
         int out_size  = av_samples_get_buffer_size(NULL, mAudioTgtChannels, out_count, mAudioTgtFmt, 0);
         int len2 = 0;
         if (out_size < 0) {
@@ -1358,6 +2620,12 @@ int32_t SoftFFmpegAudio::resampleAudio() {
             return ERR_INVALID_PARAM;
         }
 
+        uint8_t *out[] = {getAudioBuffer(out_size)};
+        if (out[0] == NULL) {
+            ALOGE("failed to get a resample buffer of %d bytes", out_size);
+            return ERR_OOM;
+        }
+
         len2 = swr_convert(mSwrCtx, out, out_count, in, mFrame->nb_samples);
         if (len2 < 0) {
             ALOGE("audio_resample() failed");
@@ -1367,7 +2635,7 @@ int32_t SoftFFmpegAudio::resampleAudio() {
             ALOGE("warning: audio buffer is probably too small");
             swr_init(mSwrCtx);
         }
-        mResampledData = mAudioBuffer;
+        mResampledData = out[0];
         mResampledDataSize = len2 * mAudioTgtChannels * av_get_bytes_per_sample(mAudioTgtFmt);
 
 #if DEBUG_FRM
@@ -1379,45 +2647,43 @@ int32_t SoftFFmpegAudio::resampleAudio() {
                 mAudioTgtChannels,
                 av_get_sample_fmt_name(mAudioTgtFmt));
 #endif
-    } else {
-        mResampledData = mFrame->data[0];
-        mResampledDataSize = dataSize;
-
-#if DEBUG_FRM
-    ALOGV("ffmpeg audio decoder(no resample),"
-            "nb_samples(before resample):%d, mResampledDataSize:%d",
-            mFrame->nb_samples, mResampledDataSize);
-#endif
+        mConvertedFrames++;
     }
 
 	return ERR_OK;
 }
 
 void SoftFFmpegAudio::drainOneOutputBuffer() {
-    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
-	BufferInfo *outInfo = *outQueue.begin();
+	BufferInfo *outInfo = getFillBuffer();
 	CHECK(outInfo != NULL);
 	OMX_BUFFERHEADERTYPE *outHeader = outInfo->mHeader;
 
 	CHECK_GT(mResampledDataSize, 0);
 
+    size_t frameBytes = av_get_bytes_per_sample(mAudioTgtFmt) * mAudioTgtChannels;
+    size_t room = outHeader->nAllocLen - mOutputFilled;
+    room -= room % frameBytes;
+
     size_t copy = mResampledDataSize;
-    if (mResampledDataSize > kOutputBufferSize) {
-        copy = kOutputBufferSize;
+    if (copy > room) {
+        copy = room;
 	}
 
-    outHeader->nOffset = 0;
-    outHeader->nFilledLen = copy;
-    outHeader->nTimeStamp = mAudioClock; 
-    memcpy(outHeader->pBuffer, mResampledData, copy);
-    outHeader->nFlags = 0;
+    if (mOutputFilled == 0) {
+        outHeader->nOffset = 0;
+        outHeader->nTimeStamp = mAudioClock;
+        outHeader->nFlags = 0;
+    }
+    memcpy(outHeader->pBuffer + mOutputFilled, mResampledData, copy);
+    mOutputFilled += copy;
+    outHeader->nFilledLen = mOutputFilled;
 
     //update mResampledSize
     mResampledData += copy;
     mResampledDataSize -= copy;
 
     //update audio pts
-    size_t frames = copy / (av_get_bytes_per_sample(mAudioTgtFmt) * mAudioTgtChannels);
+    size_t frames = copy / frameBytes;
     mAudioClock += (frames * 1000000ll) / mAudioTgtFreq;
 
 #if DEBUG_FRM
@@ -1425,14 +2691,90 @@ void SoftFFmpegAudio::drainOneOutputBuffer() {
             copy, outHeader->nTimeStamp);
 #endif
 
-    outQueue.erase(outQueue.begin());
-    outInfo->mOwnedByUs = false;
-    notifyFillBufferDone(outHeader);
+    releaseHeldBuffers(getPaddingBytes());
+
+    //hold the buffer while there is room for more frames: in low-power
+    //mode until it is full, otherwise while there is input or decoder
+    //delay to take them from, onQueueFilled() returns it when that runs out
+    if (room - copy >= frameBytes) {
+        if (mLowPower) {
+            return;
+        }
+        if (mBatchOutput && (mEOSStatus != INPUT_DATA_AVAILABLE
+                || !getPortQueue(kInputPortIndex).empty()
+                || !mDecodeJobs.empty())) {
+            return;
+        }
+    }
+
+    releaseOutputBuffer();
+}
+
+void SoftFFmpegAudio::releaseOutputBuffer() {
+	BufferInfo *outInfo = getFillBuffer();
+	CHECK(outInfo != NULL);
+	OMX_BUFFERHEADERTYPE *outHeader = outInfo->mHeader;
+
+	CHECK_GT(mOutputFilled, 0);
+
+#if DEBUG_BATCH
+    mBatchBytes += mOutputFilled;
+    mBatchBuffers++;
+    int64_t bytesPerSec = (int64_t)mAudioTgtFreq * mAudioTgtChannels
+            * av_get_bytes_per_sample(mAudioTgtFmt);
+    if (mBatchBytes >= 10 * bytesPerSec) {
+        ALOGI("%d output buffers per second of audio, %lld bytes each",
+                (int)(mBatchBuffers * bytesPerSec / mBatchBytes),
+                mBatchBytes / mBatchBuffers);
+        mBatchBytes = 0;
+        mBatchBuffers = 0;
+    }
+#endif
+
+    mOutputFilled = 0;
+
+    //it may end up with encoder padding, it goes out once there is
+    //more than that behind it
+    mNumHeldBuffers++;
+    mHeldBytes += outHeader->nFilledLen;
+    releaseHeldBuffers(getPaddingBytes());
+}
+
+//the held output buffers go out from the first on, as long as keepBytes
+//are still behind them
+void SoftFFmpegAudio::releaseHeldBuffers(int32_t keepBytes) {
+    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
+
+    while (mNumHeldBuffers > 0) {
+        BufferInfo *outInfo = *outQueue.begin();
+        OMX_BUFFERHEADERTYPE *outHeader = outInfo->mHeader;
+
+        if (mHeldBytes - (int32_t)outHeader->nFilledLen + mOutputFilled < keepBytes) {
+            break;
+        }
+        mNumHeldBuffers--;
+        mHeldBytes -= outHeader->nFilledLen;
+
+        outQueue.erase(outQueue.begin());
+        outInfo->mOwnedByUs = false;
+        notifyFillBufferDone(outHeader);
+    }
+}
+
+//the output buffer being filled, behind the ones held back
+SoftFFmpegAudio::BufferInfo *SoftFFmpegAudio::getFillBuffer() {
+    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
+    List<BufferInfo *>::iterator it = outQueue.begin();
+
+    for (int32_t i = 0; i < mNumHeldBuffers && it != outQueue.end(); i++) {
+        ++it;
+    }
+    return it != outQueue.end() ? *it : NULL;
 }
 
 void SoftFFmpegAudio::drainEOSOutputBuffer() {
     List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
-	BufferInfo *outInfo = *outQueue.begin();
+	BufferInfo *outInfo = getFillBuffer();
 	CHECK(outInfo != NULL);
 	OMX_BUFFERHEADERTYPE *outHeader = outInfo->mHeader;
 
@@ -1440,9 +2782,30 @@ void SoftFFmpegAudio::drainEOSOutputBuffer() {
 
     ALOGD("ffmpeg audio decoder fill eos outbuf");
 
-    outHeader->nTimeStamp = 0;
-    outHeader->nFilledLen = 0;
+    //the encoder padding is cut from the end: the buffer with the flag
+    //first, then the held ones, which keep mHeldBytes - trim bytes
+    int32_t trim = getPaddingBytes();
+    int32_t cut = FFMIN(trim, mOutputFilled);
+    mOutputFilled -= cut;
+    trim -= cut;
+
+    int32_t keep = FFMAX(mHeldBytes - trim, 0);
+    List<BufferInfo *>::iterator it = outQueue.begin();
+    for (int32_t i = 0; i < mNumHeldBuffers; i++, ++it) {
+        OMX_BUFFERHEADERTYPE *header = (*it)->mHeader;
+        header->nFilledLen = FFMIN((int32_t)header->nFilledLen, keep);
+        keep -= header->nFilledLen;
+    }
+    mHeldBytes = FFMAX(mHeldBytes - trim, 0);
+    releaseHeldBuffers(0);
+
+    //a partly filled buffer goes out with the flag
+    if (mOutputFilled == 0) {
+        outHeader->nTimeStamp = 0;
+    }
+    outHeader->nFilledLen = mOutputFilled;
     outHeader->nFlags = OMX_BUFFERFLAG_EOS;
+    mOutputFilled = 0;
 
     outQueue.erase(outQueue.begin());
     outInfo->mOwnedByUs = false;
@@ -1452,23 +2815,29 @@ void SoftFFmpegAudio::drainEOSOutputBuffer() {
 }
 
 void SoftFFmpegAudio::drainAllOutputBuffers() {
-    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
-
-    if (!mCodecAlreadyOpened) {
+    if (!mCodecAlreadyOpened && !mPassthrough) {
         drainEOSOutputBuffer();
         mEOSStatus = OUTPUT_FRAMES_FLUSHED;
         return;
     }
 
-    if(!(mCtx->codec->capabilities & CODEC_CAP_DELAY)) {
+    if (!mPassthrough && mNumDecodeWorkers == 0
+            && !(mCtx->codec->capabilities & CODEC_CAP_DELAY)) {
+        //what is left of the last frame goes first
+        while (mResampledDataSize > 0 && getFillBuffer() != NULL) {
+            drainOneOutputBuffer();
+        }
+        if (getFillBuffer() == NULL) {
+            return;
+        }
         drainEOSOutputBuffer();
         mEOSStatus = OUTPUT_FRAMES_FLUSHED;
         return;
     }
 
-    while (!outQueue.empty()) {
+    while (getFillBuffer() != NULL) {
         if (mResampledDataSize == 0) {
-            int32_t err = decodeAudio();
+            int32_t err = decodeNextAudio();
             if (err < ERR_OK) {
                 notify(OMX_EventError, OMX_ErrorUndefined, 0, NULL);
                 mSignalledError = true;
@@ -1500,20 +2869,21 @@ void SoftFFmpegAudio::onQueueFilled(OMX_U32 portIndex) {
     }
 
     List<BufferInfo *> &inQueue = getPortQueue(kInputPortIndex);
-    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
 
-    while (((mEOSStatus != INPUT_DATA_AVAILABLE) || !inQueue.empty())
-            && !outQueue.empty()) {
+    //with the decode workers there may be frames to take with no input
+    while (((mEOSStatus != INPUT_DATA_AVAILABLE) || !inQueue.empty()
+                || !mDecodeJobs.empty())
+            && getFillBuffer() != NULL) {
 
         if (mEOSStatus == INPUT_EOS_SEEN) {
             drainAllOutputBuffers();
             return;
         }
 
-        inInfo   = *inQueue.begin();
-        inHeader = inInfo->mHeader;
+        inInfo   = inQueue.empty() ? NULL : *inQueue.begin();
+        inHeader = inInfo ? inInfo->mHeader : NULL;
 
-        if (inHeader->nFlags & OMX_BUFFERFLAG_EOS) {
+        if (inHeader && (inHeader->nFlags & OMX_BUFFERFLAG_EOS)) {
             ALOGD("ffmpeg audio decoder empty eos inbuf");
             inQueue.erase(inQueue.begin());
             inInfo->mOwnedByUs = false;
@@ -1522,7 +2892,7 @@ void SoftFFmpegAudio::onQueueFilled(OMX_U32 portIndex) {
             continue;
         }
 
-        if (inHeader->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+        if (inHeader && (inHeader->nFlags & OMX_BUFFERFLAG_CODECCONFIG)) {
 		    if (handleExtradata() != ERR_OK) {
                 notify(OMX_EventError, OMX_ErrorUndefined, 0, NULL);
                 mSignalledError = true;
@@ -1531,7 +2901,11 @@ void SoftFFmpegAudio::onQueueFilled(OMX_U32 portIndex) {
             continue;
         }
 
-        if (!mCodecAlreadyOpened) {
+        if (mPassthrough) {
+            initPassthrough();
+        }
+
+        if (!mPassthrough && !mCodecAlreadyOpened) {
             if (openDecoder() != ERR_OK) {
                 notify(OMX_EventError, OMX_ErrorUndefined, 0, NULL);
                 mSignalledError = true;
@@ -1540,13 +2914,17 @@ void SoftFFmpegAudio::onQueueFilled(OMX_U32 portIndex) {
         }
 
 		if (mResampledDataSize == 0) {
-			int32_t err = decodeAudio();
+			int32_t err = decodeNextAudio();
             if (err < ERR_OK) {
                 notify(OMX_EventError, OMX_ErrorUndefined, 0, NULL);
                 mSignalledError = true;
 			    return;
             } else if (err == ERR_NO_FRM) {
                 CHECK_EQ(mResampledDataSize, 0);
+                //the decode workers are still at it
+                if (inQueue.empty()) {
+                    break;
+                }
                 continue;
 			} else {
                 CHECK_EQ(err, ERR_OK);
@@ -1557,22 +2935,42 @@ void SoftFFmpegAudio::onQueueFilled(OMX_U32 portIndex) {
 			drainOneOutputBuffer();
 		}
     }
+
+    //out of input, what has been packed so far goes to the sink now
+    if (mOutputFilled > 0 && !mLowPower && mEOSStatus == INPUT_DATA_AVAILABLE
+            && inQueue.empty() && getFillBuffer() != NULL) {
+        releaseOutputBuffer();
+    }
 }
 
 void SoftFFmpegAudio::onPortFlushCompleted(OMX_U32 portIndex) {
     ALOGV("ffmpeg audio decoder flush port(%lu)", portIndex);
+    //a partly filled output buffer is either returned or stale now, the
+    //held ones too
+    mOutputFilled = 0;
+    mNumHeldBuffers = 0;
+    mHeldBytes = 0;
     if (portIndex == kInputPortIndex) {
         if (mCtx) {
             //Make sure that the next buffer output does not still
             //depend on fragments from the last one decoded.
             avcodec_flush_buffers(mCtx);
         }
+        flushDecodeWorkers();
+        if (mParser) {
+            //drop the partial frame the parser holds
+            av_parser_close(mParser);
+            mParser = av_parser_init(mCtx->codec_id);
+        }
 
 	    mAudioClock = 0;
 	    mInputBufferSize = 0;
 	    mResampledDataSize = 0;
 	    mResampledData = NULL;
         mEOSStatus = INPUT_DATA_AVAILABLE;
+        //trim the encoder delay again if playback restarts from the top
+        mSkipSamples = mEncoderDelay;
+        mCheckSkip = true;
     }
 }
 
@@ -1581,6 +2979,12 @@ void SoftFFmpegAudio::onPortEnableCompleted(OMX_U32 portIndex, bool enabled) {
         return;
     }
 
+    if (!enabled) {
+        mOutputFilled = 0;
+        mNumHeldBuffers = 0;
+        mHeldBytes = 0;
+    }
+
     switch (mOutputPortSettingsChange) {
         case NONE:
             break;
@@ -20,14 +20,13 @@
 
 #include "SimpleSoftOMXComponent.h"
 
-#ifndef __GNUC__
-//fix DECLARE_ALIGNED
-#error "__GNUC__ cflags should be enabled"
-#endif
+#include <utils/threads.h>
+#include <utils/List.h>
 
-#include "utils/ffmpeg_utils.h"
+#include <pthread.h>
 
-const int AVCODEC_MAX_AUDIO_FRAME_SIZE = 192000; // Deprecated in ffmpeg
+#include "utils/ffmpeg_utils.h"
+#include "utils/spdif_packer.h"
 
 namespace android {
 
@@ -46,6 +45,9 @@ protected:
     virtual OMX_ERRORTYPE internalSetParameter(
             OMX_INDEXTYPE index, const OMX_PTR params);
 
+    virtual OMX_ERRORTYPE getExtensionIndex(
+            const char *name, OMX_INDEXTYPE *index);
+
     virtual void onQueueFilled(OMX_U32 portIndex);
     virtual void onPortFlushCompleted(OMX_U32 portIndex);
     virtual void onPortEnableCompleted(OMX_U32 portIndex, bool enabled);
@@ -56,7 +58,8 @@ private:
         kOutputPortIndex  = 1,
         kNumInputBuffers  = 4,
         kNumOutputBuffers = 4,
-        kOutputBufferSize = 4608 * 2
+        kOutputBufferSize = 4608 * 2,
+        kMaxDecodeWorkers = 4
     };
 
     enum {
@@ -110,15 +113,122 @@ private:
     int64_t mAudioClock;
     int32_t mInputBufferSize;
 
-    //"Fatal signal 7 (SIGBUS)"!!! SIGBUS is because of an alignment exception
-    //LOCAL_CFLAGS += -D__GNUC__=1 in *.cpp file
-    //Don't malloc mAudioBuffer", because "NEON optimised stereo fltp to s16
-    //conversion" require byte alignment.
-    DECLARE_ALIGNED(16, uint8_t, mAudioBuffer)[AVCODEC_MAX_AUDIO_FRAME_SIZE * 4];
+    //see DEBUG_CPU
+    int64_t mCpuUs;
+    int64_t mCpuSamples;
+    int64_t mConvertedFrames;
+    int64_t mDecodedFrames;
+
+    //resampler output, sized for the frame at hand and taken from a pool
+    //shared by all instances, which only grows while any is alive. an
+    //instance holds one buffer at most, idle ones pin no more than that.
+    //av_malloc'ed, so aligned as the NEON optimised stereo fltp to s16
+    //conversion requires, an unaligned buffer SIGBUSes.
+    AVBufferRef *mAudioBuffer;
+    static Mutex sAudioPoolLock;
+    static AVBufferPool *sAudioPool;
+    static int sAudioPoolSize;
+    static int sAudioPoolUsers;
 
-    uint8_t mSilenceBuffer[kOutputBufferSize];
     uint8_t *mResampledData;
     int32_t mResampledDataSize;
+    //of the last frame at the output rate, as much silence is played
+    //instead of a frame which fails to decode
+    int32_t mLastFrameSamples;
+
+    //convert the common decoder formats with our own kernels, see
+    //utils/audio_utils.h, swresample does the rest
+    bool mAudioKernels;
+
+    //output buffers sized from the codec's frame size at the target
+    //format. in low-power mode they are larger and filled with several
+    //frames before they go out, mOutputFilled bytes of the first one
+    //in the queue are in use.
+    bool mLowPower;
+    int32_t mOutputFilled;
+    //pack the frames of all queued input into as few output buffers as
+    //they fill, rather than one buffer per frame
+    bool mBatchOutput;
+    //DEBUG_BATCH, bytes and output buffers returned
+    int64_t mBatchBytes;
+    int32_t mBatchBuffers;
+
+    //what the sink takes, see OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE
+    int mMaxOutputChannels;
+    int mMaxOutputFreq;
+    //interleaved float instead of s16, negotiated with the pcm parameters
+    bool mFloatOutput;
+
+    //AC3/DTS passthrough: frames split by the parser go out as IEC 61937
+    //bursts, the decoder is never opened
+    bool mPassthrough;
+    AVCodecParserContext *mParser;
+    SpdifPacker *mSpdif;
+
+    //parallel decoding of codecs whose packets decode independently of
+    //each other (FLAC, APE): each worker has a context of its own and
+    //decodes whole packets copied out of the input buffers, the frames
+    //are taken back in input order on the OMX thread and converted
+    //there. at most 2 packets per worker are ahead of the output.
+    //
+    //in decode-ahead mode the workers keep mDecodeAheadUs of decoded
+    //audio ready instead, so that a frame which takes longer than a
+    //buffer period to decode doesn't starve the sink. codecs whose
+    //packets depend on each other get a single worker then, mDecodedUs
+    //is what is ready.
+    struct DecodeJob {
+        AVPacket pkt;           //empty to drain the decoder delay at eos
+        int64_t timeUs;         //of the input buffer, AV_NOPTS_VALUE if none
+        int64_t durationUs;     //of the frames, once done
+        List<AVFrame *> frames;
+        bool busy;
+        bool done;
+        bool failed;
+
+        DecodeJob()
+            : timeUs(AV_NOPTS_VALUE),
+              durationUs(0),
+              busy(false),
+              done(false),
+              failed(false) {
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+        }
+    };
+    int mNumDecodeWorkers;
+    int mDecodeWorkersRunning;
+    pthread_t mDecodeWorkers[kMaxDecodeWorkers];
+    AVCodecContext *mWorkerCtx[kMaxDecodeWorkers];
+    Mutex mDecodeLock;
+    Condition mDecodeCond;      //signalled to the workers
+    Condition mReadyCond;       //signalled to the OMX thread
+    List<DecodeJob *> mDecodeJobs;
+    bool mStopDecode;
+    int64_t mDecodeAheadUs;
+    int64_t mDecodedUs;
+    bool mDecodeDrainQueued;
+    //the head job wasn't done when output was due, once per stall and
+    //not while starting up
+    int32_t mDecodeUnderruns;
+    bool mDecodeStarved;
+    //lowest and time-weighted sum of mDecodedUs while the workers run,
+    //logged with the underruns when they stop, every 10s with DEBUG_AHEAD
+    int64_t mLevelMinUs;
+    int64_t mLevelSumUs;
+    int64_t mLevelSpanUs;
+
+    //gapless playback: mEncoderDelay samples of the source are dropped
+    //at the start, mSkipSamples of them are still to go, mEncoderPadding
+    //at the end. the output buffers which may end up holding padding are
+    //held back at the front of the queue until eos, mNumHeldBuffers of
+    //them with mHeldBytes.
+    int32_t mEncoderDelay;
+    int32_t mEncoderPadding;
+    int32_t mSkipSamples;
+    bool mCheckSkip;
+    int32_t mNumHeldBuffers;
+    int32_t mHeldBytes;
 
     int mAudioSrcFreq;
     int mAudioTgtFreq;
@@ -141,6 +251,8 @@ private:
 	void resetCtx();
 	OMX_ERRORTYPE isRoleSupported(const OMX_PARAM_COMPONENTROLETYPE *roleParams);
 	void adjustAudioParams();
+    int32_t getCodecFrameSize();
+    void updateOutputBuffers();
     bool isConfigured();
 
     void initPorts();
@@ -153,10 +265,37 @@ private:
     int32_t handleVorbisExtradata(OMX_BUFFERHEADERTYPE *inHeader);
     int32_t openDecoder();
 	void    updateTimeStamp(OMX_BUFFERHEADERTYPE *inHeader);
+    void    updateSkipSamples(int64_t timeUs);
+    void    trimEncoderDelay();
+    int32_t getPaddingBytes();
 	void    initPacket(AVPacket *pkt, OMX_BUFFERHEADERTYPE *inHeader);
 	int32_t decodeAudio();
+    bool    initPassthrough();
+    void    deinitPassthrough();
+    int32_t passthroughAudio();
+    int32_t decodeNextAudio();
+    bool    isFrameIndependent();
+    void    startDecodeWorkers();
+    void    stopDecodeWorkers();
+    void    flushDecodeWorkers();
+    void    clearDecodeJobs();
+    bool    isDecodeAheadFull();
+    void    updateDecodeLevel(int64_t frameUs);
+    static void *DecodeWorkerWrapper(void *me);
+    void    decodeWorkerEntry();
+    void    decodeJob(AVCodecContext *avctx, DecodeJob *job);
+    int32_t queueDecodeJobs();
+    int32_t decodeAudioParallel();
+    uint8_t *getAudioBuffer(int size);
     int32_t resampleAudio();
+    int32_t playSilence();
+    bool    convertAudio(int64_t channelLayout);
+    void    checkAudioKernel(int64_t channelLayout, int64_t kernelUs);
+    void    updateCpuStats(int64_t cpuUs);
     void    drainOneOutputBuffer();
+    void    releaseOutputBuffer();
+    void    releaseHeldBuffers(int32_t keepBytes);
+    BufferInfo *getFillBuffer();
     void    drainEOSOutputBuffer();
     void    drainAllOutputBuffers();
 
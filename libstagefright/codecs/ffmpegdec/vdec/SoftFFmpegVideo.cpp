@@ -20,17 +20,80 @@
 
 #include "SoftFFmpegVideo.h"
 
+#include <cutils/properties.h>
+
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MetaData.h>
+
+#include "utils/codec_pool.h"
+#include "utils/codec_utils.h"
+#include "utils/ffmpeg_omx_ext.h"
+#include "utils/packet_ref.h"
+#include "utils/video_utils.h"
 
 #define DEBUG_PKT 0
 #define DEBUG_FRM 0
+#define DEBUG_CONV 0 //per-resolution conversion time
+#define DEBUG_DEC  0 //decoding throughput per threading mode
 
 static int decoder_reorder_pts = -1;
 
 namespace android {
 
+//frame skipping escalates as the decoder falls behind, a level is entered
+//once we are later than its lateUs, and left below half of that
+static const struct {
+    enum AVDiscard loopFilter;
+    enum AVDiscard idct;
+    enum AVDiscard frame;
+    int64_t lateUs;
+} kSkipLevels[] = {
+    { AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT,      0 },
+    { AVDISCARD_NONREF,  AVDISCARD_DEFAULT, AVDISCARD_DEFAULT,  40000 },
+    { AVDISCARD_NONREF,  AVDISCARD_NONREF,  AVDISCARD_NONREF,   80000 },
+    { AVDISCARD_BIDIR,   AVDISCARD_BIDIR,   AVDISCARD_BIDIR,   160000 },
+    { AVDISCARD_ALL,     AVDISCARD_NONKEY,  AVDISCARD_NONKEY,  320000 },
+};
+static const int kMaxSkipLevel = sizeof(kSkipLevels) / sizeof(kSkipLevels[0]) - 1;
+//frames to stay on a level before relaxing it, avoids flapping
+static const int kSkipRelaxFrames = 16;
+
+//largest downscale factor we accept, 1/8 of each dimension
+static const int kMaxLowres = 3;
+
+//decoder threads, sys.media.vdec.threads overrides the cpu count
+static const int kMaxDecoderThreads = 16;
+
+//output colour formats in order of preference, nIndex of the
+//OMX_IndexParamVideoPortFormat enumeration
+static const OMX_COLOR_FORMATTYPE kOutputColorFormats[] = {
+    OMX_COLOR_FormatYUV420Planar,
+    OMX_COLOR_FormatYUV420SemiPlanar,           //NV12
+    OMX_QCOM_COLOR_FormatYVU420SemiPlanar,      //NV21
+};
+static const size_t kNumOutputColorFormats =
+        sizeof(kOutputColorFormats) / sizeof(kOutputColorFormats[0]);
+
+//output buffers the client may ask for with sys.media.vdec.outbufs
+static const int kMaxOutputBuffers = 16;
+//stride alignment in bytes. no padding by default, JB's renderer takes
+//the frame width as the pitch. sys.media.vdec.align takes 16/32/64.
+static const int kDefaultStrideAlign = 1;
+//slice height alignment in rows once padded, one macroblock row
+static const int kSliceHeightAlign = 16;
+
+//decode worker: packets copied ahead of it, and decoded frames it may
+//keep ahead of the output
+static const size_t kMaxDecodePackets = 8;
+static const size_t kMaxReadyFrames = 2;
+
+//direct rendering: packets since the last keyframe kept to decode again
+//after a flush, a longer keyframe interval is not replayed
+static const size_t kMaxReplayPackets = 120;
+
 template<class T>
 static void InitOMXParams(T *params) {
     params->nSize = sizeof(T);
@@ -63,6 +126,8 @@ void SoftFFmpegVideo::setMode(const char *name) {
         mMode = MODE_DIVX;
     } else if (!strcmp(name, "OMX.ffmpeg.hevc.decoder")) {
         mMode = MODE_HEVC;
+    } else if (!strcmp(name, "OMX.ffmpeg.vp9.decoder")) {
+        mMode = MODE_VP9;
     } else if (!strcmp(name, "OMX.ffmpeg.vtrial.decoder")) {
         mMode = MODE_TRIAL;
     } else {
@@ -92,10 +157,77 @@ SoftFFmpegVideo::SoftFFmpegVideo(
       mWidth(320),
       mHeight(240),
       mStride(320),
+      mSliceHeight(240),
+      mAdaptivePlayback(false),
+      mAdaptiveMaxWidth(0),
+      mAdaptiveMaxHeight(0),
+      mColorFormat(OMX_COLOR_FormatYUV420Planar),
+      mNumOutputBuffers(kNumOutputBuffers),
+      mStrideAlign(kDefaultStrideAlign),
+      mPaddedFrameSize(false),
+      mDirectRendering(false),
+      mDRReplayValid(false),
+      mWaitKeyFrame(false),
+      mScratchPool(NULL),
+      mScratchSize(0),
+      mConvTimeUs(0),
+      mConvFrames(0),
+      mSkipEnabled(true),
+      mSkipLevel(0),
+      mSkipFrames(0),
+      mLateUs(0),
+      mBusyUs(0),
+      mLastInputTimeUs(-1),
+      mLowres(0),
+      mDownscale(0),
+      mDecStartUs(-1),
+      mDecFrames(0),
+      mAsyncDecode(false),
+      mDecodeThreadStarted(false),
+      mDecodeBusy(false),
+      mDecodeDrained(false),
+      mStopDecode(false),
       mOutputPortSettingsChange(NONE) {
 
     setMode(name);
 
+    //setprop sys.media.vdec.drop 0 turns off adaptive frame skipping
+    char value[PROPERTY_VALUE_MAX];
+    property_get("sys.media.vdec.drop", value, "1");
+    mSkipEnabled = atoi(value) != 0;
+
+    //more output buffers let the renderer hold frames without stalling us
+    property_get("sys.media.vdec.outbufs", value, "0");
+    int count = atoi(value);
+    if (count > 0) {
+        mNumOutputBuffers = count < kNumOutputBuffers ? kNumOutputBuffers
+                : (count > kMaxOutputBuffers ? kMaxOutputBuffers : count);
+    }
+
+    property_get("sys.media.vdec.align", value, "0");
+    int align = atoi(value);
+    if (align == 16 || align == 32 || align == 64) {
+        mStrideAlign = align;
+    }
+
+    //JB's software renderer takes the frame size as the stride, with
+    //sys.media.vdec.align it needs sys.media.vdec.padframe 1 to
+    //advertise the padded size
+    property_get("sys.media.vdec.padframe", value, "0");
+    mPaddedFrameSize = atoi(value) != 0;
+
+    //setprop sys.media.vdec.async 1 decodes on a worker thread, which
+    //turns off direct rendering: only the OMX thread may hand out the
+    //output buffers the decoder writes into
+    property_get("sys.media.vdec.async", value, "0");
+    mAsyncDecode = atoi(value) != 0;
+
+    ALOGD("output buffers: %d, stride alignment: %d, padded frame size: %d, "
+            "async decoding: %d", mNumOutputBuffers, mStrideAlign,
+            mPaddedFrameSize, mAsyncDecode);
+
+    updateBufferGeometry();
+
     ALOGD("SoftFFmpegVideo component: %s mMode: %d", name, mMode);
 
     initPorts();
@@ -157,6 +289,10 @@ void SoftFFmpegVideo::initInputFormat(uint32_t mode,
         def.format.video.cMIMEType = const_cast<char *>(MEDIA_MIMETYPE_VIDEO_HEVC);
         def.format.video.eCompressionFormat = OMX_VIDEO_CodingHEVC;
         break;
+    case MODE_VP9:
+        def.format.video.cMIMEType = const_cast<char *>(FFMPEG_MIMETYPE_VIDEO_VP9);
+        def.format.video.eCompressionFormat = (OMX_VIDEO_CODINGTYPE)OMX_VIDEO_CodingFFmpegVP9;
+        break;
     case MODE_TRIAL:
         def.format.video.cMIMEType = const_cast<char *>(MEDIA_MIMETYPE_VIDEO_FFMPEG);
         def.format.video.eCompressionFormat = OMX_VIDEO_CodingAutoDetect;
@@ -200,28 +336,28 @@ void SoftFFmpegVideo::initPorts() {
     def.nPortIndex = 1;
     def.eDir = OMX_DirOutput;
     def.nBufferCountMin = kNumOutputBuffers;
-    def.nBufferCountActual = def.nBufferCountMin;
+    def.nBufferCountActual = mNumOutputBuffers;
     def.bEnabled = OMX_TRUE;
     def.bPopulated = OMX_FALSE;
     def.eDomain = OMX_PortDomainVideo;
     def.bBuffersContiguous = OMX_FALSE;
-    def.nBufferAlignment = 2;
+    def.nBufferAlignment = mStrideAlign;
 
     def.format.video.cMIMEType = const_cast<char *>(MEDIA_MIMETYPE_VIDEO_RAW);
     def.format.video.pNativeRender = NULL;
-    def.format.video.nFrameWidth = mWidth;
-    def.format.video.nFrameHeight = mHeight;
-    def.format.video.nStride = def.format.video.nFrameWidth;
-    def.format.video.nSliceHeight = def.format.video.nFrameHeight;
+    def.format.video.nFrameWidth = mPaddedFrameSize ? mStride : mWidth;
+    def.format.video.nFrameHeight = mPaddedFrameSize ? mSliceHeight : mHeight;
+    def.format.video.nStride = mStride;
+    def.format.video.nSliceHeight = mSliceHeight;
     def.format.video.nBitrate = 0;
     def.format.video.xFramerate = 0;
     def.format.video.bFlagErrorConcealment = OMX_FALSE;
     def.format.video.eCompressionFormat = OMX_VIDEO_CodingUnused;
-    def.format.video.eColorFormat = OMX_COLOR_FormatYUV420Planar;
+    def.format.video.eColorFormat = mColorFormat;
     def.format.video.pNativeWindow = NULL;
 
     def.nBufferSize =
-        (def.format.video.nFrameWidth * def.format.video.nFrameHeight * 3) / 2;
+        (def.format.video.nStride * def.format.video.nSliceHeight * 3) / 2;
 
     addPort(def);
 }
@@ -230,12 +366,14 @@ void SoftFFmpegVideo::setDefaultCtx(AVCodecContext *avctx, const AVCodec *codec)
     int fast = 0;
 
     avctx->workaround_bugs   = 1;
-    avctx->lowres            = 0;
+    avctx->lowres            = mLowres;
     if(avctx->lowres > codec->max_lowres){
         ALOGW("The maximum value for lowres supported by the decoder is %d",
                 codec->max_lowres);
         avctx->lowres= codec->max_lowres;
     }
+    //whatever the decoder can't do is left to swscale
+    mDownscale = mLowres - avctx->lowres;
     avctx->idct_algo         = 0;
     avctx->skip_frame        = AVDISCARD_DEFAULT;
     avctx->skip_idct         = AVDISCARD_DEFAULT;
@@ -248,6 +386,49 @@ void SoftFFmpegVideo::setDefaultCtx(AVCodecContext *avctx, const AVCodec *codec)
         avctx->flags |= CODEC_FLAG_EMU_EDGE;
 }
 
+void SoftFFmpegVideo::setThreadCtx(AVCodecContext *avctx) {
+    char value[PROPERTY_VALUE_MAX];
+    bool tiles = false, wpp = false;
+    int threads;
+
+    //only hevc and vp9 streams are heavy enough to be worth the extra latency
+    if (mMode != MODE_HEVC && mMode != MODE_VP9) {
+        return;
+    }
+
+    property_get("sys.media.vdec.threads", value, "0");
+    threads = atoi(value);
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    threads = threads > kMaxDecoderThreads ? kMaxDecoderThreads : threads;
+    if (threads <= 1) {
+        return;
+    }
+
+    //there is nothing to tell before the first frame header, let ffmpeg
+    //take frame threads, or tile column threads where the vp9 decoder
+    //only has those
+    if (mMode == MODE_VP9) {
+        avctx->thread_count = threads;
+        avctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        ALOGI("vp9 threading: frame/tile, %d threads", threads);
+        return;
+    }
+
+    //the PPSs may as well come in-band only, then nothing is known
+    getHEVCParallelism(avctx->extradata, avctx->extradata_size, &tiles, &wpp);
+
+    //ffmpeg's slice threads decode the CTU rows of a WPP picture in
+    //parallel, but tiles still one after another, so tiled and plain
+    //streams are better off with a picture per thread
+    avctx->thread_count = threads;
+    avctx->thread_type = wpp ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+
+    ALOGI("hevc threading: %s, %d threads (tiles: %d, wpp: %d)",
+            wpp ? "slice" : "frame", threads, tiles, wpp);
+}
+
 status_t SoftFFmpegVideo::initDecoder() {
     status_t status;
     
@@ -302,6 +483,9 @@ status_t SoftFFmpegVideo::initDecoder() {
     case MODE_HEVC:
         mCtx->codec_id = AV_CODEC_ID_HEVC;
         break;
+    case MODE_VP9:
+        mCtx->codec_id = AV_CODEC_ID_VP9;
+        break;
     case MODE_TRIAL:
         mCtx->codec_id = AV_CODEC_ID_NONE;
         break;
@@ -319,21 +503,23 @@ status_t SoftFFmpegVideo::initDecoder() {
 }
 
 void SoftFFmpegVideo::deInitDecoder() {
+    stopDecodeThread();
+    if (mFrame) {
+        av_frame_unref(mFrame);
+    }
     if (mCtx) {
         if (avcodec_is_open(mCtx)) {
             avcodec_flush_buffers(mCtx);
         }
-        if (mCtx->extradata) {
-            av_free(mCtx->extradata);
-            mCtx->extradata = NULL;
-            mCtx->extradata_size = 0;
-        }
-        if (mCodecAlreadyOpened) {
-            avcodec_close(mCtx);
-            av_free(mCtx);
-            mCtx = NULL;
+        //a decoder still holding our output buffers must not outlive us,
+        //otherwise it is kept warm for the next instance
+        if (mCodecAlreadyOpened && !hasPinnedOutputBuffers()) {
+            codec_pool_close(&mCtx);
+        } else {
+            codec_pool_free_context(&mCtx);
         }
     }
+    clearReplayPackets();
     if (mFrame) {
         av_freep(&mFrame);
         mFrame = NULL;
@@ -342,6 +528,7 @@ void SoftFFmpegVideo::deInitDecoder() {
         sws_freeContext(mImgConvertCtx);
         mImgConvertCtx = NULL;
     }
+    av_buffer_pool_uninit(&mScratchPool);
 }
 
 void SoftFFmpegVideo::getInputFormat(uint32_t mode,
@@ -380,6 +567,9 @@ void SoftFFmpegVideo::getInputFormat(uint32_t mode,
     case MODE_HEVC:
         formatParams->eCompressionFormat = OMX_VIDEO_CodingHEVC;
         break;
+    case MODE_VP9:
+        formatParams->eCompressionFormat = (OMX_VIDEO_CODINGTYPE)OMX_VIDEO_CodingFFmpegVP9;
+        break;
     case MODE_TRIAL:
         formatParams->eCompressionFormat = OMX_VIDEO_CodingAutoDetect;
         break;
@@ -394,7 +584,7 @@ void SoftFFmpegVideo::getInputFormat(uint32_t mode,
 OMX_ERRORTYPE SoftFFmpegVideo::internalGetParameter(
         OMX_INDEXTYPE index, OMX_PTR params) {
     //ALOGV("internalGetParameter index:0x%x", index);
-    switch (index) {
+    switch ((int)index) {
         case OMX_IndexParamVideoPortFormat:
         {
             OMX_VIDEO_PARAM_PORTFORMATTYPE *formatParams =
@@ -404,17 +594,19 @@ OMX_ERRORTYPE SoftFFmpegVideo::internalGetParameter(
                 return OMX_ErrorUndefined;
             }
 
-            if (formatParams->nIndex != 0) {
-                return OMX_ErrorNoMore;
-            }
-
             if (formatParams->nPortIndex == kInputPortIndex) {
+                if (formatParams->nIndex != 0) {
+                    return OMX_ErrorNoMore;
+                }
                 getInputFormat(mMode, formatParams);
             } else {
                 CHECK_EQ(formatParams->nPortIndex, kOutputPortIndex);
 
+                if (formatParams->nIndex >= kNumOutputColorFormats) {
+                    return OMX_ErrorNoMore;
+                }
                 formatParams->eCompressionFormat = OMX_VIDEO_CodingUnused;
-                formatParams->eColorFormat = OMX_COLOR_FormatYUV420Planar;
+                formatParams->eColorFormat = kOutputColorFormats[formatParams->nIndex];
                 formatParams->xFramerate = 0;
             }
 
@@ -465,6 +657,36 @@ OMX_ERRORTYPE SoftFFmpegVideo::internalGetParameter(
             return OMX_ErrorNone;
         }
 
+        case OMX_IndexParamFFmpegLowres:
+        {
+            OMX_FFMPEG_PARAM_LOWRESTYPE *lowresParams =
+                (OMX_FFMPEG_PARAM_LOWRESTYPE *)params;
+
+            if (lowresParams->nPortIndex != kInputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            lowresParams->nFactor = mLowres;
+
+            return OMX_ErrorNone;
+        }
+
+        case OMX_IndexParamFFmpegAdaptivePlayback:
+        {
+            OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE *adaptiveParams =
+                (OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE *)params;
+
+            if (adaptiveParams->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            adaptiveParams->bEnable = mAdaptivePlayback ? OMX_TRUE : OMX_FALSE;
+            adaptiveParams->nMaxFrameWidth = mAdaptiveMaxWidth;
+            adaptiveParams->nMaxFrameHeight = mAdaptiveMaxHeight;
+
+            return OMX_ErrorNone;
+        }
+
         default:
 
             return SimpleSoftOMXComponent::internalGetParameter(index, params);
@@ -531,6 +753,11 @@ OMX_ERRORTYPE SoftFFmpegVideo::isRoleSupported(
                 "video_decoder.hevc", OMX_MAX_STRINGNAME_SIZE - 1))
             supported = false;
             break;
+    case MODE_VP9:
+        if (strncmp((const char *)roleParams->cRole,
+                "video_decoder.vp9", OMX_MAX_STRINGNAME_SIZE - 1))
+            supported = false;
+            break;
     case MODE_TRIAL:
         if (strncmp((const char *)roleParams->cRole,
                 "video_decoder.trial", OMX_MAX_STRINGNAME_SIZE - 1))
@@ -551,7 +778,7 @@ OMX_ERRORTYPE SoftFFmpegVideo::isRoleSupported(
 OMX_ERRORTYPE SoftFFmpegVideo::internalSetParameter(
         OMX_INDEXTYPE index, const OMX_PTR params) {
     //ALOGV("internalSetParameter index:0x%x", index);
-    switch (index) {
+    switch ((int)index) {
         case OMX_IndexParamStandardComponentRole:
         {
             const OMX_PARAM_COMPONENTROLETYPE *roleParams =
@@ -568,6 +795,27 @@ OMX_ERRORTYPE SoftFFmpegVideo::internalSetParameter(
                 return OMX_ErrorUndefined;
             }
 
+            if (formatParams->nPortIndex == kOutputPortIndex) {
+                size_t i = 0;
+                while (i < kNumOutputColorFormats
+                        && kOutputColorFormats[i] != formatParams->eColorFormat) {
+                    i++;
+                }
+                if (i == kNumOutputColorFormats) {
+                    return OMX_ErrorUnsupportedSetting;
+                }
+                //the buffer layout depends on it
+                if (formatParams->eColorFormat != mColorFormat
+                        && editPortInfo(kOutputPortIndex)->mDef.bPopulated) {
+                    return OMX_ErrorIncorrectStateOperation;
+                }
+                mColorFormat = formatParams->eColorFormat;
+                ALOGD("got OMX_IndexParamVideoPortFormat, color format: 0x%x",
+                        mColorFormat);
+                updatePortDefinitions();
+                return OMX_ErrorNone;
+            }
+
             if (formatParams->nIndex != 0) {
                 return OMX_ErrorNoMore;
             }
@@ -590,10 +838,29 @@ OMX_ERRORTYPE SoftFFmpegVideo::internalSetParameter(
             //only care about input port
             if (defParams->nPortIndex == kOutputPortIndex) {
                 OMX_VIDEO_PORTDEFINITIONTYPE *video_def = &defParams->format.video;
+                OMX_PARAM_PORTDEFINITIONTYPE *def = &editPortInfo(kOutputPortIndex)->mDef;
+                //the client may allocate more buffers than we ask for
+                if (defParams->nBufferCountActual != def->nBufferCountActual) {
+                    if (defParams->nBufferCountActual < def->nBufferCountMin
+                            || defParams->nBufferCountActual > (OMX_U32)kMaxOutputBuffers
+                            || def->bPopulated) {
+                        return OMX_ErrorBadParameter;
+                    }
+                    def->nBufferCountActual = defParams->nBufferCountActual;
+                    ALOGV("got OMX_IndexParamPortDefinition, output buffers: %lu",
+                            def->nBufferCountActual);
+                }
+                //our own padded size handed back is no picture size
+                if (video_def->nFrameWidth == 0 || video_def->nFrameHeight == 0
+                        || (video_def->nFrameWidth == def->format.video.nFrameWidth
+                        && video_def->nFrameHeight == def->format.video.nFrameHeight)) {
+                    return OMX_ErrorNone;
+                }
                 mCtx->width = video_def->nFrameWidth;
                 mCtx->height = video_def->nFrameHeight;
                 ALOGV("got OMX_IndexParamPortDefinition, width: %lu, height: %lu",
                         video_def->nFrameWidth, video_def->nFrameHeight);
+                updateOutputSize();
                 return OMX_ErrorNone;
             }
 
@@ -669,24 +936,264 @@ OMX_ERRORTYPE SoftFFmpegVideo::internalSetParameter(
             return OMX_ErrorNone;
         }
 
+        case OMX_IndexParamFFmpegLowres:
+        {
+            OMX_FFMPEG_PARAM_LOWRESTYPE *lowresParams =
+                (OMX_FFMPEG_PARAM_LOWRESTYPE *)params;
+
+            if (lowresParams->nPortIndex != kInputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            if (mCodecAlreadyOpened) {
+                return OMX_ErrorIncorrectStateOperation;
+            }
+
+            mLowres = lowresParams->nFactor > (OMX_U32)kMaxLowres
+                    ? kMaxLowres : lowresParams->nFactor;
+            ALOGD("got OMX_IndexParamFFmpegLowres, factor: %d", mLowres);
+
+            //the client sizes the output buffers after this
+            updateOutputSize();
+
+            return OMX_ErrorNone;
+        }
+
+        case OMX_IndexParamFFmpegAdaptivePlayback:
+        {
+            OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE *adaptiveParams =
+                (OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE *)params;
+
+            if (adaptiveParams->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            //the output buffers are sized by it, too late once they exist
+            if (editPortInfo(kOutputPortIndex)->mDef.bPopulated) {
+                return OMX_ErrorIncorrectStateOperation;
+            }
+
+            mAdaptivePlayback = adaptiveParams->bEnable == OMX_TRUE;
+            mAdaptiveMaxWidth = mAdaptivePlayback ? adaptiveParams->nMaxFrameWidth : 0;
+            mAdaptiveMaxHeight = mAdaptivePlayback ? adaptiveParams->nMaxFrameHeight : 0;
+            ALOGD("got OMX_IndexParamFFmpegAdaptivePlayback, enable: %d, max: %dx%d",
+                    mAdaptivePlayback, mAdaptiveMaxWidth, mAdaptiveMaxHeight);
+
+            updateBufferGeometry();
+            updatePortDefinitions();
+
+            return OMX_ErrorNone;
+        }
+
+        case OMX_IndexParamFFmpegCodecParams:
+        {
+            OMX_FFMPEG_PARAM_CODECPARAMSTYPE *codecParams =
+                (OMX_FFMPEG_PARAM_CODECPARAMSTYPE *)params;
+
+            if (codecParams->nPortIndex != kInputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            if (mCodecAlreadyOpened) {
+                return OMX_ErrorIncorrectStateOperation;
+            }
+
+            status_t err = unpackCodecParams(mCtx,
+                    codecParams->nData, codecParams->nDataSize);
+            if (err != OK) {
+                ALOGW("ignore OMX_IndexParamFFmpegCodecParams (%d)", err);
+                return OMX_ErrorBadParameter;
+            }
+            //the extradata is complete, codec config buffers only repeat it
+            mExtradataReady = true;
+
+            ALOGD("got OMX_IndexParamFFmpegCodecParams, codec: %s, %dx%d, "
+                    "extradata size: %d", avcodec_get_name(mCtx->codec_id),
+                    mCtx->width, mCtx->height, mCtx->extradata_size);
+
+            updateOutputSize();
+
+            return OMX_ErrorNone;
+        }
+
         default:
 
             return SimpleSoftOMXComponent::internalSetParameter(index, params);
     }
 }
 
+OMX_ERRORTYPE SoftFFmpegVideo::getExtensionIndex(
+        const char *name, OMX_INDEXTYPE *index) {
+    if (!strcmp(name, FFMPEG_OMX_INDEX_LOWRES)) {
+        *index = (OMX_INDEXTYPE)OMX_IndexParamFFmpegLowres;
+        return OMX_ErrorNone;
+    }
+
+    if (!strcmp(name, FFMPEG_OMX_INDEX_ADAPTIVE_PLAYBACK)
+            || !strcmp(name, FFMPEG_OMX_INDEX_ANDROID_ADAPTIVE_PLAYBACK)) {
+        *index = (OMX_INDEXTYPE)OMX_IndexParamFFmpegAdaptivePlayback;
+        return OMX_ErrorNone;
+    }
+
+    if (!strcmp(name, FFMPEG_OMX_INDEX_CODEC_PARAMS)) {
+        *index = (OMX_INDEXTYPE)OMX_IndexParamFFmpegCodecParams;
+        return OMX_ErrorNone;
+    }
+
+    return SimpleSoftOMXComponent::getExtensionIndex(name, index);
+}
+
+OMX_ERRORTYPE SoftFFmpegVideo::getConfig(
+        OMX_INDEXTYPE index, OMX_PTR params) {
+    switch (index) {
+        case OMX_IndexConfigCommonOutputCrop:
+        {
+            OMX_CONFIG_RECTTYPE *rectParams = (OMX_CONFIG_RECTTYPE *)params;
+
+            if (rectParams->nPortIndex != kOutputPortIndex) {
+                return OMX_ErrorUndefined;
+            }
+
+            rectParams->nLeft = 0;
+            rectParams->nTop = 0;
+            rectParams->nWidth = mWidth;
+            rectParams->nHeight = mHeight;
+
+            return OMX_ErrorNone;
+        }
+
+        default:
+            return OMX_ErrorUnsupportedIndex;
+    }
+}
+
+void SoftFFmpegVideo::updateBufferGeometry() {
+    int32_t width = mWidth, height = mHeight;
+
+    //adaptive buffers are laid out for the largest picture, smaller ones
+    //sit at their top left corner and are cropped
+    if (mAdaptivePlayback) {
+        width = FFMAX(mWidth, mAdaptiveMaxWidth);
+        height = FFMAX(mHeight, mAdaptiveMaxHeight);
+    }
+
+    //aligned luma rows, the chroma rows get half of the alignment and
+    //every plane starts aligned too, so both sides can use vector loads
+    mStride = FFALIGN(width, mStrideAlign);
+    mSliceHeight = FFALIGN(height, getSliceHeightAlign());
+}
+
+//rows are only padded along with the stride
+int32_t SoftFFmpegVideo::getSliceHeightAlign() {
+    return mStrideAlign > 1 ? kSliceHeightAlign : 1;
+}
+
+bool SoftFFmpegVideo::isCropOnlyChange() {
+    int32_t width, height;
+
+    getOutputSize(&width, &height);
+    if (mAdaptivePlayback) {
+        return width <= mStride && height <= mSliceHeight;
+    }
+    //same padded geometry, e.g. 1920x1080 -> 1920x1088
+    return FFALIGN(width, mStrideAlign) == mStride
+            && FFALIGN(height, getSliceHeightAlign()) == mSliceHeight;
+}
+
+AVPixelFormat SoftFFmpegVideo::getOutputPixelFormat() {
+    switch ((int)mColorFormat) {
+        case OMX_COLOR_FormatYUV420SemiPlanar:
+            return AV_PIX_FMT_NV12;
+        case OMX_QCOM_COLOR_FormatYVU420SemiPlanar:
+            return AV_PIX_FMT_NV21;
+        default:
+            return AV_PIX_FMT_YUV420P;
+    }
+}
+
+void SoftFFmpegVideo::fillOutputPicture(AVPicture *pict, uint8_t *dst) {
+    pict->data[0] = dst;
+    pict->data[1] = dst + mStride * mSliceHeight;
+    pict->linesize[0] = mStride;
+
+    //semi-planar chroma rows are as long as the luma ones
+    if (getOutputPixelFormat() != AV_PIX_FMT_YUV420P) {
+        pict->linesize[1] = mStride;
+        return;
+    }
+
+    pict->data[2] = pict->data[1] + (mStride / 2 * mSliceHeight / 2);
+    pict->linesize[1] = mStride / 2;
+    pict->linesize[2] = mStride / 2;
+}
+
+size_t SoftFFmpegVideo::getOutputFrameSize() {
+    return (mStride * mSliceHeight * 3) / 2;
+}
+
+void SoftFFmpegVideo::getOutputSize(int32_t *width, int32_t *height) {
+    //before the decoder is opened mCtx has the full size
+    int shift = mCodecAlreadyOpened ? mDownscale : mLowres;
+    int w = mCtx->width;
+    int h = mCtx->height;
+
+    //the worker may already be decoding the next picture into mCtx,
+    //the frame in hand is the one to size the output for
+    if (mAsyncDecode && mFrame && mFrame->width > 0) {
+        w = mFrame->width;
+        h = mFrame->height;
+    }
+
+    *width  = -((-w) >> shift);
+    *height = -((-h) >> shift);
+}
+
+void SoftFFmpegVideo::updateOutputSize() {
+    getOutputSize(&mWidth, &mHeight);
+    updateBufferGeometry();
+    updatePortDefinitions();
+}
+
 bool SoftFFmpegVideo::isPortSettingChanged() {
-    return (mCtx->width != mWidth || mCtx->height != mHeight);
+    int32_t width, height;
+
+    getOutputSize(&width, &height);
+    return (width != mWidth || height != mHeight);
 }
 
 bool SoftFFmpegVideo::handlePortSettingChangeEvent() {
-    if (mCtx->width != mWidth || mCtx->height != mHeight) {
-       ALOGI("ffmpeg video port setting change event(%dx%d)->(%dx%d).",
-               mWidth, mHeight, mCtx->width, mCtx->height);
+    int32_t width, height;
 
-       mWidth = mCtx->width;
-       mHeight = mCtx->height;
-       mStride = mWidth;
+    getOutputSize(&width, &height);
+    if (width != mWidth || height != mHeight) {
+       ALOGI("ffmpeg video port setting change event(%dx%d)->(%dx%d).",
+               mWidth, mHeight, width, height);
+
+       mConvTimeUs = 0;
+       mConvFrames = 0;
+
+       //only the crop changes, the output buffers and the port definition
+       //stay as they are, the client learns nothing else
+       if (isCropOnlyChange()) {
+           mWidth = width;
+           mHeight = height;
+           notify(OMX_EventPortSettingsChanged, kOutputPortIndex,
+                   OMX_IndexConfigCommonOutputCrop, NULL);
+           return true;
+       }
+
+       mWidth = width;
+       mHeight = height;
+       if (mAdaptivePlayback) {
+           mAdaptiveMaxWidth = FFMAX(mAdaptiveMaxWidth, width);
+           mAdaptiveMaxHeight = FFMAX(mAdaptiveMaxHeight, height);
+       }
+       updateBufferGeometry();
+
+       //the output buffers are about to be freed by the client
+       if (hasPinnedOutputBuffers()) {
+           dropDirectRendering(mFrame);
+       }
 
        updatePortDefinitions();
        notify(OMX_EventPortSettingsChanged, 1, 0, NULL);
@@ -756,11 +1263,25 @@ int32_t SoftFFmpegVideo::openDecoder() {
     }
 
     setDefaultCtx(mCtx, mCtx->codec);
+    setThreadCtx(mCtx);
+
+    //ffmpeg asks for frame buffers on the thread which decodes, the
+    //worker must not go through the output queue for them
+    if ((mCtx->codec->capabilities & CODEC_CAP_DR1) && !mAsyncDecode) {
+        mDirectRendering = true;
+        mCtx->opaque = this;
+        mCtx->get_buffer2 = GetBufferWrapper;
+    }
+    //mFrame holds its own reference, so a frame living in one of our
+    //output buffers can't be recycled by ffmpeg before it is drained
+    mCtx->refcounted_frames = 1;
 
     ALOGD("begin to open ffmpeg decoder(%s) now",
             avcodec_get_name(mCtx->codec_id));
 
-    int err = avcodec_open2(mCtx, mCtx->codec, NULL);
+    //may hand back a warm decoder of the same stream, the lowres
+    //factor it was opened with has to match
+    int err = codec_pool_open(&mCtx, mCtx->codec, mLowres);
     if (err < 0) {
         ALOGE("ffmpeg video decoder failed to initialize. (%s)", av_err2str(err));
         return ERR_DECODER_OPEN_FAILED;
@@ -776,18 +1297,39 @@ int32_t SoftFFmpegVideo::openDecoder() {
         return ERR_OOM;
     }
 
+    if (mAsyncDecode && startDecodeThread() != OK) {
+        ALOGE("failed to start the decode thread");
+        return ERR_OOM;
+    }
+
     return ERR_OK;
 }
 
-void SoftFFmpegVideo::initPacket(AVPacket *pkt,
+//ERR_PACKET_LOST if the input is a packet reference which was dropped
+//before we got to it, the stream has a hole then. the packet must be
+//freed after use.
+int32_t SoftFFmpegVideo::initPacket(AVPacket *pkt,
         OMX_BUFFERHEADERTYPE *inHeader) {
     memset(pkt, 0, sizeof(AVPacket));
     av_init_packet(pkt);
 
     if (inHeader) {
-        pkt->data = (uint8_t *)inHeader->pBuffer + inHeader->nOffset;
-        pkt->size = inHeader->nFilledLen;
-        pkt->pts = inHeader->nTimeStamp;
+        uint8_t *data = inHeader->pBuffer + inHeader->nOffset;
+        int err = packet_ref_take(data, inHeader->nFilledLen, pkt);
+        if (err == 0) {
+            //the demuxer's own packet, see packet_ref.h
+            pkt->pts = inHeader->nTimeStamp;
+            pkt->dts = AV_NOPTS_VALUE;
+        } else if (err == AVERROR(ENOENT)) {
+            ALOGE("the packet of input buffer %p is gone", inHeader);
+            return ERR_PACKET_LOST;
+        } else {
+            pkt->data = data;
+            pkt->size = inHeader->nFilledLen;
+            pkt->pts = inHeader->nTimeStamp;
+            //the client copied the payload into our buffer
+            packet_ref_count_copy(pkt->size);
+        }
     } else {
         pkt->data = NULL;
         pkt->size = 0;
@@ -802,6 +1344,8 @@ void SoftFFmpegVideo::initPacket(AVPacket *pkt,
         ALOGV("pkt size:%d, pts:N/A", pkt->size);
     }
 #endif
+
+    return ERR_OK;
 }
 
 int32_t SoftFFmpegVideo::decodeVideo() {
@@ -820,11 +1364,25 @@ int32_t SoftFFmpegVideo::decodeVideo() {
     }
 
     AVPacket pkt;
-    initPacket(&pkt, inHeader);
-    //av_frame_unref(mFrame); //Don't unref mFrame!!!
-    avcodec_get_frame_defaults(mFrame);
+    if (initPacket(&pkt, inHeader) != ERR_OK) {
+        inQueue.erase(inQueue.begin());
+        inInfo->mOwnedByUs = false;
+        notifyEmptyBufferDone(inHeader);
+        return ERR_PACKET_LOST;
+    }
+    av_frame_unref(mFrame);
 
+    int64_t startUs = ALooper::GetNowUs();
     int err = avcodec_decode_video2(mCtx, mFrame, &gotPic, &pkt);
+    mBusyUs += ALooper::GetNowUs() - startUs;
+    if (mDirectRendering && pkt.data) {
+        keepReplayPacket(&pkt);
+    }
+    if (mWaitKeyFrame && gotPic && mFrame->key_frame) {
+        mWaitKeyFrame = false;
+        mCtx->skip_frame = kSkipLevels[mSkipLevel].frame;
+    }
+    av_free_packet(&pkt);
     if (err < 0) {
         ALOGE("ffmpeg video decoder failed to decode frame. (%d)", err);
         //don't send error to OMXCodec, skip!
@@ -844,11 +1402,14 @@ int32_t SoftFFmpegVideo::decodeVideo() {
             if (mPendingSettingChangeEvent) {
                 mPendingFrameAsSettingChanged = true;
             }
+            updateDecodeStats();
 			ret = ERR_OK;
         }
     }
 
 	if (!is_flush) {
+        updateSkipLevel(inHeader->nTimeStamp);
+
         inQueue.erase(inQueue.begin());
         inInfo->mOwnedByUs = false;
         notifyEmptyBufferDone(inHeader);
@@ -857,84 +1418,558 @@ int32_t SoftFFmpegVideo::decodeVideo() {
 	return ret;
 }
 
-int32_t SoftFFmpegVideo::preProcessVideoFrame(AVPicture *picture, void **bufp) {
-    AVPicture *picture2;
+void SoftFFmpegVideo::updateDecodeStats() {
+#if DEBUG_DEC
+    //wall clock, meaningful when the decoder is not paced
+    int64_t nowUs = ALooper::GetNowUs();
+    if (mDecStartUs < 0) {
+        mDecStartUs = nowUs;
+    } else if (++mDecFrames % 100 == 0) {
+        ALOGI("decoding %dx%d, %s threading, %d threads%s: %lld fps",
+                mCtx->width, mCtx->height,
+                mCtx->active_thread_type == FF_THREAD_FRAME ? "frame"
+                : (mCtx->active_thread_type == FF_THREAD_SLICE ? "slice" : "no"),
+                mCtx->thread_count, mDecodeThreadStarted ? ", async" : "",
+                mDecFrames * 1000000LL / (nowUs - mDecStartUs + 1));
+    }
+#endif
+}
+
+//Lateness is the time we spent decoding and converting minus the media
+//time which the input timestamps advanced meanwhile. It only grows while
+//we are slower than realtime and is clamped at zero when we are ahead.
+void SoftFFmpegVideo::updateSkipLevel(int64_t timeUs) {
+    int64_t mediaUs = 0;
+    int level = mSkipLevel;
+
+    //timestamps come in decode order, count only the forward progress
+    if (timeUs > mLastInputTimeUs) {
+        if (mLastInputTimeUs >= 0) {
+            mediaUs = timeUs - mLastInputTimeUs;
+        }
+        mLastInputTimeUs = timeUs;
+    }
+
+    mLateUs += mBusyUs - mediaUs;
+    if (mLateUs < 0) {
+        mLateUs = 0;
+    }
+    mBusyUs = 0;
+
+    if (!mSkipEnabled) {
+        return;
+    }
+
+    mSkipFrames++;
+    if (level < kMaxSkipLevel && mLateUs > kSkipLevels[level + 1].lateUs) {
+        level++;
+    } else if (level > 0 && mLateUs < kSkipLevels[level].lateUs / 2
+            && mSkipFrames >= kSkipRelaxFrames) {
+        level--;
+    }
+
+    if (level != mSkipLevel) {
+        setSkipLevel(level);
+    }
+}
+
+void SoftFFmpegVideo::setSkipLevel(int level) {
+    ALOGI("ffmpeg video decoder skip level %d -> %d, late %lld ms",
+            mSkipLevel, level, mLateUs / 1000);
+
+    mCtx->skip_loop_filter = kSkipLevels[level].loopFilter;
+    mCtx->skip_idct        = kSkipLevels[level].idct;
+    mCtx->skip_frame       = mWaitKeyFrame ? AVDISCARD_NONKEY
+            : kSkipLevels[level].frame;
+
+    mSkipLevel = level;
+    mSkipFrames = 0;
+}
+
+int32_t SoftFFmpegVideo::preProcessVideoFrame(AVPicture *picture, AVBufferRef **bufp) {
     AVPicture picture_tmp;
-    uint8_t *buf = NULL;
+    AVBufferRef *buf = NULL;
+    AVPixelFormat fmt = (AVPixelFormat)mFrame->format;
+    int width = mFrame->width;
+    int height = mFrame->height;
 
     //deinterlace : must be done before any resize
-    if (mDoDeinterlace) {
-        int size = 0;
-
-        //create temporary picture
-        size = avpicture_get_size(mCtx->pix_fmt, mCtx->width, mCtx->height);
-        buf  = (uint8_t *)av_malloc(size);
-        if (!buf) {
-            ALOGE("oom for temporary picture");
-            return ERR_OOM;
+    int size = avpicture_get_size(fmt, width, height);
+    if (size < 0) {
+        return ERR_OK;
+    }
+
+    //scratch pictures come from a pool which lives as long as the frame size
+    if (mScratchPool == NULL || mScratchSize != size) {
+        av_buffer_pool_uninit(&mScratchPool);
+        mScratchPool = av_buffer_pool_init(size, NULL);
+        mScratchSize = size;
+    }
+    buf = mScratchPool ? av_buffer_pool_get(mScratchPool) : NULL;
+    if (!buf) {
+        ALOGE("oom for temporary picture");
+        return ERR_OOM;
+    }
+
+    avpicture_fill(&picture_tmp, buf->data, fmt, width, height);
+
+    if (avpicture_deinterlace(&picture_tmp, picture, fmt, width, height) < 0) {
+        //if error, do not deinterlace
+        ALOGE("Deinterlacing failed");
+        av_buffer_unref(&buf);
+        return ERR_OK;
+    }
+
+    *picture = picture_tmp;
+    *bufp = buf;
+
+    return ERR_OK;
+}
+
+// static
+int SoftFFmpegVideo::GetBufferWrapper(AVCodecContext *avctx,
+        AVFrame *frame, int flags) {
+    return static_cast<SoftFFmpegVideo *>(avctx->opaque)->getBuffer(
+            avctx, frame, flags);
+}
+
+// static
+void SoftFFmpegVideo::ReleaseBufferWrapper(void *opaque, uint8_t *data) {
+    static_cast<SoftFFmpegVideo *>(opaque)->releaseBuffer(data);
+}
+
+bool SoftFFmpegVideo::canDirectRender(AVCodecContext *avctx,
+        AVFrame *frame, int *align) {
+    int w = frame->width;
+    int h = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+
+    if (!mDirectRendering || mOutputPortSettingsChange != NONE) {
+        return false;
+    }
+
+    //only planar output buffers of the current size can be decoded into
+    if (getOutputPixelFormat() != AV_PIX_FMT_YUV420P
+            || (frame->format != AV_PIX_FMT_YUV420P
+                && frame->format != AV_PIX_FMT_YUVJ420P)
+            || avctx->width != mWidth || avctx->height != mHeight) {
+        return false;
+    }
+
+    //the decoder writes up to the aligned size, which must neither
+    //overlap the next row nor run into the next plane
+    avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+    if (w > mStride || h > mSliceHeight) {
+        return false;
+    }
+    if ((mStride % linesize_align[0])
+            || ((mStride / 2) % linesize_align[1])
+            || ((mStride / 2) % linesize_align[2])) {
+        return false;
+    }
+
+    *align = linesize_align[0];
+    return true;
+}
+
+OMX_BUFFERHEADERTYPE *SoftFFmpegVideo::pinOutputBuffer(size_t size, int align) {
+    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
+    OMX_U32 count = editPortInfo(kOutputPortIndex)->mDef.nBufferCountActual;
+    Mutex::Autolock autoLock(mDRLock);
+
+    //keep one buffer for the renderer to hold and one for frames which
+    //still need a copy, otherwise the pipeline may stall
+    if (mDRPinned.size() + 2 > count) {
+        return NULL;
+    }
+
+    for (List<BufferInfo *>::iterator it = outQueue.begin();
+            it != outQueue.end(); ++it) {
+        OMX_BUFFERHEADERTYPE *header = (*it)->mHeader;
+        bool pinned = false;
+
+        for (size_t i = 0; i < mDRPinned.size(); i++) {
+            if (mDRPinned.itemAt(i) == header->pBuffer) {
+                pinned = true;
+                break;
+            }
+        }
+        if (pinned || header->nAllocLen < size
+                || ((uintptr_t)header->pBuffer & (align - 1))) {
+            continue;
+        }
+
+        mDRPinned.push(header->pBuffer);
+        return header;
+    }
+
+    return NULL;
+}
+
+int SoftFFmpegVideo::getBuffer(AVCodecContext *avctx,
+        AVFrame *frame, int flags) {
+    OMX_BUFFERHEADERTYPE *outHeader = NULL;
+    size_t size = getOutputFrameSize();
+    int align = 1;
+    uint8_t *dst = NULL;
+
+    if (canDirectRender(avctx, frame, &align)) {
+        outHeader = pinOutputBuffer(size, align);
+    }
+    if (outHeader == NULL) {
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+    }
+
+    dst = outHeader->pBuffer;
+    frame->buf[0] = av_buffer_create(dst, size,
+            ReleaseBufferWrapper, this, 0);
+    if (!frame->buf[0]) {
+        releaseBuffer(dst);
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+    }
+
+    fillOutputPicture((AVPicture *)frame, dst);
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+void SoftFFmpegVideo::releaseBuffer(uint8_t *data) {
+    Mutex::Autolock autoLock(mDRLock);
+
+    for (size_t i = 0; i < mDRPinned.size(); i++) {
+        if (mDRPinned.itemAt(i) == data) {
+            mDRPinned.removeAt(i);
+            return;
+        }
+    }
+}
+
+bool SoftFFmpegVideo::isPinned(uint8_t *data) {
+    Mutex::Autolock autoLock(mDRLock);
+
+    for (size_t i = 0; i < mDRPinned.size(); i++) {
+        if (mDRPinned.itemAt(i) == data) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SoftFFmpegVideo::hasPinnedOutputBuffers() {
+    Mutex::Autolock autoLock(mDRLock);
+    return !mDRPinned.isEmpty();
+}
+
+//true if the decoder references memory which is none of the current
+//output buffers: the client freed them on the way to Loaded, which JB
+//doesn't tell us about, and allocated new ones since
+bool SoftFFmpegVideo::hasStalePins() {
+    const Vector<BufferInfo> &buffers = editPortInfo(kOutputPortIndex)->mBuffers;
+    Mutex::Autolock autoLock(mDRLock);
+
+    for (size_t i = 0; i < mDRPinned.size(); i++) {
+        size_t j = 0;
+        while (j < buffers.size()
+                && buffers.itemAt(j).mHeader->pBuffer != mDRPinned.itemAt(i)) {
+            j++;
         }
+        if (j == buffers.size()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//only the demuxer's packets, see packet_ref.h, are kept and only shared:
+//the input buffers are never copied for this. a keyframe starts over.
+void SoftFFmpegVideo::keepReplayPacket(const AVPacket *pkt) {
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+        clearReplayPackets();
+        mDRReplayValid = true;
+    }
+    if (!mDRReplayValid) {
+        return;
+    }
+    if (!pkt->buf || mDRReplay.size() >= kMaxReplayPackets) {
+        clearReplayPackets();
+        return;
+    }
+
+    AVPacket *ref = (AVPacket *)av_malloc(sizeof(AVPacket));
+    if (!ref) {
+        clearReplayPackets();
+        return;
+    }
+    *ref = *pkt;
+    ref->side_data = NULL;
+    ref->side_data_elems = 0;
+    ref->buf = av_buffer_ref(pkt->buf);
+    if (!ref->buf) {
+        av_free(ref);
+        clearReplayPackets();
+        return;
+    }
+    mDRReplay.push_back(ref);
+}
+
+void SoftFFmpegVideo::clearReplayPackets() {
+    for (List<AVPacket *>::iterator it = mDRReplay.begin();
+            it != mDRReplay.end(); ++it) {
+        av_free_packet(*it);
+        av_free(*it);
+    }
+    mDRReplay.clear();
+    mDRReplayValid = false;
+}
+
+//Make ffmpeg let go of every output buffer before the client may free
+//them. Only a flush drops the references held by the DPB and the frame
+//threads, and it drops the pictures the next output depends on as well.
+//If keep is the first picture after a size change, which stays out of
+//the output buffers, the decoder is brought back by decoding again the
+//packets from keep's one on, the new size starts with a keyframe.
+//Without them non-key frames are skipped until the next keyframe.
+void SoftFFmpegVideo::dropDirectRendering(const AVFrame *keep) {
+    List<AVPacket *>::iterator from = mDRReplay.end();
+    int replayed = 0;
+    int dropped = 0;
+    bool found = false;
+
+    if (isDirectRendered(mFrame)) {
+        av_frame_unref(mFrame);
+    }
 
-        picture2 = &picture_tmp;
-        avpicture_fill(picture2, buf, mCtx->pix_fmt, mCtx->width, mCtx->height);
+    if (keep && keep->pkt_pts != AV_NOPTS_VALUE) {
+        for (List<AVPacket *>::iterator it = mDRReplay.begin();
+                it != mDRReplay.end(); ++it) {
+            if ((*it)->pts == keep->pkt_pts) {
+                from = it;
+                found = true;
+            }
+        }
+    }
 
-        if (avpicture_deinterlace(picture2, picture,
-                mCtx->pix_fmt, mCtx->width, mCtx->height) < 0) {
-            //if error, do not deinterlace
-            ALOGE("Deinterlacing failed");
-            av_free(buf);
-            buf = NULL;
-            picture2 = picture;
+    avcodec_flush_buffers(mCtx);
+
+    //none of this goes to the output, nor may it pin an output buffer
+    mDirectRendering = false;
+    AVFrame *frame = av_frame_alloc();
+    for (List<AVPacket *>::iterator it = from;
+            frame && it != mDRReplay.end(); ++it) {
+        int gotPic = 0;
+        if (avcodec_decode_video2(mCtx, frame, &gotPic, *it) >= 0 && gotPic) {
+            if (frame->pkt_pts != keep->pkt_pts) {
+                dropped++;
+            }
+            av_frame_unref(frame);
         }
+        replayed++;
+    }
+    av_frame_free(&frame);
+    mDirectRendering = true;
+    clearReplayPackets();
+
+    if (!found) {
+        ALOGW("no packets to restore the decoder from, wait for a keyframe");
+        mWaitKeyFrame = true;
+        mCtx->skip_frame = AVDISCARD_NONKEY;
+    }
+    ALOGI("dropped the decoder's output buffer references, "
+            "%d packets decoded again, %d frames dropped", replayed, dropped);
+
+    //nothing may reference the output buffers now
+    Mutex::Autolock autoLock(mDRLock);
+    if (!mDRPinned.isEmpty()) {
+        ALOGE("%d output buffers still referenced after a flush",
+                (int)mDRPinned.size());
+        mDRPinned.clear();
+    }
+}
+
+bool SoftFFmpegVideo::isDirectRendered(AVFrame *frame) {
+    return frame->buf[0] && av_buffer_get_opaque(frame->buf[0]) == this;
+}
+
+List<SoftFFmpegVideo::BufferInfo *>::iterator
+SoftFFmpegVideo::findOutputBuffer(uint8_t *data) {
+    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
+    List<BufferInfo *>::iterator it = outQueue.begin();
+
+    while (it != outQueue.end() && (*it)->mHeader->pBuffer != data) {
+        ++it;
+    }
+    return it;
+}
+
+List<SoftFFmpegVideo::BufferInfo *>::iterator
+SoftFFmpegVideo::findFreeOutputBuffer() {
+    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
+    List<BufferInfo *>::iterator it = outQueue.begin();
+
+    //pinned buffers are still referenced by the decoder, never write them
+    while (it != outQueue.end() && isPinned((*it)->mHeader->pBuffer)) {
+        ++it;
+    }
+    return it;
+}
+
+bool SoftFFmpegVideo::isOutputBufferAvailable() {
+    return findFreeOutputBuffer() != getPortQueue(kOutputPortIndex).end();
+}
+
+int32_t SoftFFmpegVideo::convertFrame(uint8_t *dst) {
+    AVPicture pict;
+    AVPicture src = *(AVPicture *)mFrame;
+    AVBufferRef *scratch = NULL;
+    int cw = (mWidth + 1) >> 1;
+    int ch = (mHeight + 1) >> 1;
+    int fmt = mFrame->format;
+    AVPixelFormat outFmt = getOutputPixelFormat();
+    int32_t err = ERR_OK;
+#if DEBUG_CONV
+    int64_t startUs = ALooper::GetNowUs();
+    const char *path = NULL;
+#endif
+
+    memset(&pict, 0, sizeof(AVPicture));
+    fillOutputPicture(&pict, dst);
+
+    //progressive frames are never deinterlaced
+    bool deinterlace = mDoDeinterlace && mFrame->interlaced_frame;
+
+    //swscale is only needed for real format or size conversions,
+    //8-bit 4:2:0 frames of the port size are just copied, with the
+    //chroma planes split or merged on the way where needed
+    bool sameSize = (mFrame->width == mWidth && mFrame->height == mHeight);
+    bool planar = (fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P);
+    bool semiPlanar = (fmt == AV_PIX_FMT_NV12 || fmt == AV_PIX_FMT_NV21);
+
+    if (sameSize && planar && outFmt == AV_PIX_FMT_YUV420P) {
+        //deinterlace straight into the output buffer, it is the copy
+        if (deinterlace && avpicture_deinterlace(&pict, &src,
+                (AVPixelFormat)fmt, mWidth, mHeight) >= 0) {
+#if DEBUG_CONV
+            path = "deinterlace";
+#endif
+        } else {
+            copy_plane(pict.data[0], pict.linesize[0],
+                    src.data[0], src.linesize[0], mWidth, mHeight);
+            copy_plane(pict.data[1], pict.linesize[1],
+                    src.data[1], src.linesize[1], cw, ch);
+            copy_plane(pict.data[2], pict.linesize[2],
+                    src.data[2], src.linesize[2], cw, ch);
+#if DEBUG_CONV
+            path = "copy";
+#endif
+        }
+    } else if (sameSize && planar && !deinterlace) {
+        int u = (outFmt == AV_PIX_FMT_NV12) ? 1 : 2;
+        copy_plane(pict.data[0], pict.linesize[0],
+                src.data[0], src.linesize[0], mWidth, mHeight);
+        merge_uv_plane(pict.data[1], pict.linesize[1],
+                src.data[u], src.linesize[u],
+                src.data[3 - u], src.linesize[3 - u], cw, ch);
+#if DEBUG_CONV
+        path = "merge";
+#endif
+    } else if (sameSize && fmt == outFmt) {
+        copy_plane(pict.data[0], pict.linesize[0],
+                src.data[0], src.linesize[0], mWidth, mHeight);
+        copy_plane(pict.data[1], pict.linesize[1],
+                src.data[1], src.linesize[1], cw * 2, ch);
+#if DEBUG_CONV
+        path = "copy";
+#endif
+    } else if (sameSize && semiPlanar && outFmt == AV_PIX_FMT_YUV420P) {
+        int u = (fmt == AV_PIX_FMT_NV12) ? 1 : 2;
+        copy_plane(pict.data[0], pict.linesize[0],
+                src.data[0], src.linesize[0], mWidth, mHeight);
+        split_uv_plane(pict.data[u], pict.linesize[u],
+                pict.data[3 - u], pict.linesize[3 - u],
+                src.data[1], src.linesize[1], cw, ch);
+#if DEBUG_CONV
+        path = "shuffle";
+#endif
     } else {
-        picture2 = picture;
+        //deinterlace : must be done before any resize
+        if (deinterlace) {
+            err = preProcessVideoFrame(&src, &scratch);
+            if (err != ERR_OK) {
+                ALOGE("preProcessVideoFrame failed");
+                return err;
+            }
+        }
+
+        //a downscale which the decoder can't do itself has to be fast
+        int sws_flags = mDownscale ? SWS_FAST_BILINEAR : SWS_BICUBIC;
+        mImgConvertCtx = sws_getCachedContext(mImgConvertCtx,
+               mFrame->width, mFrame->height, (AVPixelFormat)fmt, mWidth, mHeight,
+               outFmt, sws_flags, NULL, NULL, NULL);
+        if (mImgConvertCtx == NULL) {
+            ALOGE("Cannot initialize the conversion context");
+            av_buffer_unref(&scratch);
+            return ERR_SWS_FAILED;
+        }
+        sws_scale(mImgConvertCtx, src.data, src.linesize,
+                0, mFrame->height, pict.data, pict.linesize);
+        av_buffer_unref(&scratch);
+#if DEBUG_CONV
+        path = "swscale";
+#endif
     }
 
-    if (picture != picture2)
-        *picture = *picture2;
-    *bufp = buf;
+#if DEBUG_CONV
+    mConvTimeUs += ALooper::GetNowUs() - startUs;
+    if (++mConvFrames % 100 == 0) {
+        ALOGI("conversion %dx%d %s(%s) -> %s: %lld us/frame",
+                mWidth, mHeight, av_get_pix_fmt_name((AVPixelFormat)fmt),
+                path, av_get_pix_fmt_name(outFmt), mConvTimeUs / mConvFrames);
+    }
+#endif
 
     return ERR_OK;
 }
 
 int32_t SoftFFmpegVideo::drainOneOutputBuffer() {
     List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
-    BufferInfo *outInfo = *outQueue.begin();
-	OMX_BUFFERHEADERTYPE *outHeader = outInfo->mHeader;
+    List<BufferInfo *>::iterator it = outQueue.end();
+    BufferInfo *outInfo = NULL;
+    OMX_BUFFERHEADERTYPE *outHeader = NULL;
 
-    AVPicture pict;
-    void *buffer_to_free = NULL;
     int64_t pts = AV_NOPTS_VALUE;
-    uint8_t *dst = outHeader->pBuffer;
+    uint8_t *dst = NULL;
 
-    //do deinterlace if necessary. for example, your TV is progressive
-    int32_t err = preProcessVideoFrame((AVPicture *)mFrame, &buffer_to_free);
-    if (err != ERR_OK) {
-        ALOGE("preProcessVideoFrame failed");
-        return err;
+    //a progressive frame decoded into an output buffer is ready as is
+    if (isDirectRendered(mFrame)
+            && (!mDoDeinterlace || !mFrame->interlaced_frame)) {
+        it = findOutputBuffer(mFrame->buf[0]->data);
     }
 
-    memset(&pict, 0, sizeof(AVPicture));
-    pict.data[0] = dst;
-    pict.data[1] = dst + mStride * mHeight;
-    pict.data[2] = pict.data[1] + (mStride / 2  * mHeight / 2);
-    pict.linesize[0] = mStride;
-    pict.linesize[1] = mStride / 2;
-    pict.linesize[2] = mStride / 2;
-
-    int sws_flags = SWS_BICUBIC;
-    mImgConvertCtx = sws_getCachedContext(mImgConvertCtx,
-           mWidth, mHeight, (AVPixelFormat)mFrame->format, mWidth, mHeight,
-           PIX_FMT_YUV420P, sws_flags, NULL, NULL, NULL);
-    if (mImgConvertCtx == NULL) {
-        ALOGE("Cannot initialize the conversion context");
-        av_free(buffer_to_free);
-        return ERR_SWS_FAILED;
-    }
-    sws_scale(mImgConvertCtx, mFrame->data, mFrame->linesize,
-            0, mHeight, pict.data, pict.linesize);
+    if (it != outQueue.end()) {
+        outInfo = *it;
+        outHeader = outInfo->mHeader;
+    } else {
+        it = findFreeOutputBuffer();
+        CHECK(it != outQueue.end());
+        outInfo = *it;
+        outHeader = outInfo->mHeader;
+        dst = outHeader->pBuffer;
+
+        int64_t startUs = ALooper::GetNowUs();
+        int32_t err = convertFrame(dst);
+        //with the worker the conversion overlaps decoding, and mBusyUs
+        //is the worker's
+        if (!mDecodeThreadStarted) {
+            mBusyUs += ALooper::GetNowUs() - startUs;
+        }
+        if (err != ERR_OK) {
+            return err;
+        }
+    }
 
     outHeader->nOffset = 0;
-    outHeader->nFilledLen = (mStride * mHeight * 3) / 2;
+    outHeader->nFilledLen = getOutputFrameSize();
     outHeader->nFlags = 0;
     if (mFrame->key_frame) {
         outHeader->nFlags |= OMX_BUFFERFLAG_SYNCFRAME;
@@ -956,15 +1991,13 @@ int32_t SoftFFmpegVideo::drainOneOutputBuffer() {
     outHeader->nTimeStamp = pts; //FIXME pts is right???
 
 #if DEBUG_FRM
-    ALOGV("mFrame pts: %lld", pts);
+    ALOGV("mFrame pts: %lld, direct: %d", pts, dst == NULL);
 #endif
 
-    outQueue.erase(outQueue.begin());
+    outQueue.erase(it);
     outInfo->mOwnedByUs = false;
     notifyFillBufferDone(outHeader);
 
-    av_free(buffer_to_free);
-
     return ERR_OK;
 }
 
@@ -988,7 +2021,6 @@ void SoftFFmpegVideo::drainEOSOutputBuffer() {
 }
 
 void SoftFFmpegVideo::drainAllOutputBuffers() {
-    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
    if (!mCodecAlreadyOpened) {
         drainEOSOutputBuffer();
         mEOSStatus = OUTPUT_FRAMES_FLUSHED;
@@ -1001,7 +2033,7 @@ void SoftFFmpegVideo::drainAllOutputBuffers() {
         return;
     }
 
-    while (!outQueue.empty()) {
+    while (isOutputBufferAvailable()) {
         if (!mPendingFrameAsSettingChanged) {
             int32_t err = decodeVideo();
 		    if (err < ERR_OK) {
@@ -1031,6 +2063,321 @@ void SoftFFmpegVideo::drainAllOutputBuffers() {
     }
 }
 
+status_t SoftFFmpegVideo::startDecodeThread() {
+    if (mDecodeThreadStarted) {
+        return OK;
+    }
+
+    mStopDecode = false;
+    mDecodeDrained = false;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    int err = pthread_create(&mDecodeThread, &attr, DecodeThreadWrapper, this);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        return UNKNOWN_ERROR;
+    }
+    mDecodeThreadStarted = true;
+    ALOGD("decode thread started");
+
+    return OK;
+}
+
+void SoftFFmpegVideo::stopDecodeThread() {
+    if (!mDecodeThreadStarted) {
+        return;
+    }
+
+    mDecodeLock.lock();
+    mStopDecode = true;
+    mDecodeCond.signal();
+    mDecodeLock.unlock();
+
+    void *dummy;
+    pthread_join(mDecodeThread, &dummy);
+    mDecodeThreadStarted = false;
+
+    Mutex::Autolock autoLock(mDecodeLock);
+    clearDecodeQueues();
+    ALOGD("decode thread stopped");
+}
+
+//wait for the packet in decoding, then drop whatever was queued
+//either way. the caller may use mCtx until it queues the next packet.
+void SoftFFmpegVideo::flushDecodeThread() {
+    if (!mDecodeThreadStarted) {
+        return;
+    }
+
+    Mutex::Autolock autoLock(mDecodeLock);
+    while (mDecodeBusy) {
+        mReadyCond.wait(mDecodeLock);
+    }
+    clearDecodeQueues();
+}
+
+//called with mDecodeLock held
+void SoftFFmpegVideo::clearDecodeQueues() {
+    for (List<AVPacket *>::iterator it = mDecodePackets.begin();
+            it != mDecodePackets.end(); ++it) {
+        av_free_packet(*it);
+        av_free(*it);
+    }
+    mDecodePackets.clear();
+
+    for (List<AVFrame *>::iterator it = mReadyFrames.begin();
+            it != mReadyFrames.end(); ++it) {
+        av_frame_free(&(*it));
+    }
+    mReadyFrames.clear();
+
+    mDecodeDrained = false;
+}
+
+// static
+void *SoftFFmpegVideo::DecodeThreadWrapper(void *me) {
+    ((SoftFFmpegVideo *)me)->decodeThreadEntry();
+
+    return NULL;
+}
+
+void SoftFFmpegVideo::decodeThreadEntry() {
+    androidSetThreadPriority(0, ANDROID_PRIORITY_VIDEO);
+
+    mDecodeLock.lock();
+    while (!mStopDecode) {
+        if (mDecodePackets.empty() || mReadyFrames.size() >= kMaxReadyFrames) {
+            mDecodeCond.wait(mDecodeLock);
+            continue;
+        }
+
+        AVPacket *pkt = *mDecodePackets.begin();
+        mDecodePackets.erase(mDecodePackets.begin());
+        mDecodeBusy = true;
+        mDecodeLock.unlock();
+
+        //a packet without data drains the decoder at eos
+        bool eos = (pkt->data == NULL);
+        int gotPic = 0;
+        AVFrame *frame = av_frame_alloc();
+        if (frame) {
+            int64_t startUs = ALooper::GetNowUs();
+            int err = avcodec_decode_video2(mCtx, frame, &gotPic, pkt);
+            mBusyUs += ALooper::GetNowUs() - startUs;
+            if (err < 0) {
+                //don't send error to OMXCodec, skip!
+                ALOGE("ffmpeg video decoder failed to decode frame. (%d)", err);
+                gotPic = 0;
+            } else if (gotPic) {
+                updateDecodeStats();
+            }
+        } else {
+            ALOGE("oom for video frame");
+        }
+        if (!eos) {
+            updateSkipLevel(pkt->pts);
+        }
+
+        mDecodeLock.lock();
+        mDecodeBusy = false;
+
+        if (gotPic) {
+            mReadyFrames.push_back(frame);
+        } else {
+            av_frame_free(&frame);
+        }
+
+        if (eos && gotPic && (mCtx->codec->capabilities & CODEC_CAP_DELAY)) {
+            //more delayed frames to come, keep draining
+            mDecodePackets.push_front(pkt);
+        } else {
+            if (eos) {
+                mDecodeDrained = true;
+            }
+            av_free_packet(pkt);
+            av_free(pkt);
+        }
+
+        mReadyCond.signal();
+    }
+    mDecodeLock.unlock();
+}
+
+//copy the input buffers into packets for the worker and hand them back
+//right away, up to kMaxDecodePackets ahead of it
+int32_t SoftFFmpegVideo::queueDecodePackets() {
+    List<BufferInfo *> &inQueue = getPortQueue(kInputPortIndex);
+
+    while (!inQueue.empty() && mEOSStatus == INPUT_DATA_AVAILABLE) {
+        BufferInfo *inInfo = *inQueue.begin();
+        OMX_BUFFERHEADERTYPE *inHeader = inInfo->mHeader;
+        AVPacket *pkt = NULL;
+
+        if (inHeader->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+            int32_t err = handleExtradata();
+            if (err != ERR_OK) {
+                return err;
+            }
+            continue;
+        }
+
+        if (inHeader->nFlags & OMX_BUFFERFLAG_EOS) {
+            ALOGD("ffmpeg video decoder empty eos inbuf");
+            mEOSStatus = INPUT_EOS_SEEN;
+        } else if (!mCodecAlreadyOpened) {
+            int32_t err = openDecoder();
+            if (err != ERR_OK) {
+                return err;
+            }
+        }
+
+        if (mDecodeThreadStarted) {
+            {
+                Mutex::Autolock autoLock(mDecodeLock);
+                if (mDecodePackets.size() >= kMaxDecodePackets
+                        && mEOSStatus == INPUT_DATA_AVAILABLE) {
+                    break;
+                }
+            }
+
+            pkt = (AVPacket *)av_malloc(sizeof(AVPacket));
+            if (!pkt) {
+                return ERR_OOM;
+            }
+            int32_t err = initPacket(pkt,
+                    mEOSStatus == INPUT_DATA_AVAILABLE ? inHeader : NULL);
+            if (err != ERR_OK) {
+                av_free(pkt);
+                return err;
+            }
+            //a packet reference is kept as it is, the payload of
+            //the input buffer is copied
+            if (pkt->data && !pkt->buf) {
+                packet_ref_count_copy(pkt->size);
+            }
+            if (av_dup_packet(pkt) < 0) {
+                av_free(pkt);
+                return ERR_OOM;
+            }
+
+            {
+                Mutex::Autolock autoLock(mDecodeLock);
+                mDecodePackets.push_back(pkt);
+                mDecodeCond.signal();
+            }
+        } else {
+            //eos before any data, there is nothing to drain
+            Mutex::Autolock autoLock(mDecodeLock);
+            mDecodeDrained = true;
+        }
+
+        inQueue.erase(inQueue.begin());
+        inInfo->mOwnedByUs = false;
+        notifyEmptyBufferDone(inHeader);
+    }
+
+    return ERR_OK;
+}
+
+//move the next decoded frame into mFrame. with wait it blocks while the
+//worker still has something to decode, otherwise it leaves the frame to
+//the next call.
+int32_t SoftFFmpegVideo::takeReadyFrame(bool wait) {
+    Mutex::Autolock autoLock(mDecodeLock);
+
+    while (mReadyFrames.empty()) {
+        if (mDecodeDrained) {
+            return ERR_FLUSHED;
+        }
+        if (!wait || (mDecodePackets.empty() && !mDecodeBusy)) {
+            return ERR_NO_FRM;
+        }
+        mReadyCond.wait(mDecodeLock);
+    }
+
+    AVFrame *frame = *mReadyFrames.begin();
+    mReadyFrames.erase(mReadyFrames.begin());
+    mDecodeCond.signal();
+
+    av_frame_unref(mFrame);
+    av_frame_move_ref(mFrame, frame);
+    av_frame_free(&frame);
+
+    return ERR_OK;
+}
+
+//Nothing but the OMX thread may call us back, so a frame the worker
+//finishes later is only delivered on the next input or output buffer.
+//While the client still holds input buffers it sends them soon enough.
+//Once it can't, at eos or with its buffers queued here, we are starved
+//and wait for the worker instead.
+void SoftFFmpegVideo::processQueuesAsync() {
+    List<BufferInfo *> &inQueue = getPortQueue(kInputPortIndex);
+    List<BufferInfo *> &outQueue = getPortQueue(kOutputPortIndex);
+
+    for (;;) {
+        if (mPendingSettingChangeEvent) {
+            //a size which fits the current buffers needs no port reconfiguration
+            if (isCropOnlyChange()) {
+                handlePortSettingChangeEvent();
+                mPendingSettingChangeEvent = false;
+                continue;
+            }
+
+            //fix crash! We don't notify event until wait for all output buffers
+            OMX_PARAM_PORTDEFINITIONTYPE *def = &editPortInfo(kOutputPortIndex)->mDef;
+            if (outQueue.size() == def->nBufferCountActual) {
+                CHECK(handlePortSettingChangeEvent() == true);
+                mPendingSettingChangeEvent = false;
+            }
+            return;
+        }
+
+        if (queueDecodePackets() != ERR_OK) {
+            notify(OMX_EventError, OMX_ErrorUndefined, 0, NULL);
+            mSignalledError = true;
+            return;
+        }
+
+        if (!isOutputBufferAvailable()) {
+            return;
+        }
+
+        //the frame which changed the port settings goes out first
+        if (!mPendingFrameAsSettingChanged) {
+            bool starved = (mEOSStatus != INPUT_DATA_AVAILABLE) || !inQueue.empty();
+            int32_t err = takeReadyFrame(starved);
+            if (err == ERR_NO_FRM) {
+                //with frame threading and reordering the decoder may need
+                //more than kMaxDecodePackets packets before its first
+                //frame. the worker is idle then, give it the input left.
+                if (mEOSStatus == INPUT_DATA_AVAILABLE && !inQueue.empty()) {
+                    continue;
+                }
+                return;
+            } else if (err == ERR_FLUSHED) {
+                drainEOSOutputBuffer();
+                return;
+            }
+
+            mPendingSettingChangeEvent = isPortSettingChanged();
+            if (mPendingSettingChangeEvent) {
+                mPendingFrameAsSettingChanged = true;
+                continue;
+            }
+        }
+
+        if (drainOneOutputBuffer() != ERR_OK) {
+            notify(OMX_EventError, OMX_ErrorUndefined, 0, NULL);
+            mSignalledError = true;
+            return;
+        }
+        mPendingFrameAsSettingChanged = false;
+    }
+}
+
 void SoftFFmpegVideo::onQueueFilled(OMX_U32 portIndex) {
     BufferInfo *inInfo = NULL;
     OMX_BUFFERHEADERTYPE *inHeader = NULL;
@@ -1045,11 +2392,28 @@ void SoftFFmpegVideo::onQueueFilled(OMX_U32 portIndex) {
         return;
     }
 
+    if (mAsyncDecode) {
+        processQueuesAsync();
+        return;
+    }
+
+    if (hasStalePins()) {
+        dropDirectRendering(NULL);
+    }
+
     while (((mEOSStatus != INPUT_DATA_AVAILABLE) || !inQueue.empty())
-            && !outQueue.empty()) {
+            && isOutputBufferAvailable()) {
         if (mPendingSettingChangeEvent) {
+            //a size which fits the current buffers needs no port reconfiguration
+            if (isCropOnlyChange()) {
+                handlePortSettingChangeEvent();
+                mPendingSettingChangeEvent = false;
+                continue;
+            }
+
             //fix crash! We don't notify event until wait for all output buffers
-            if (outQueue.size() == kNumOutputBuffers) {
+            OMX_PARAM_PORTDEFINITIONTYPE *def = &editPortInfo(kOutputPortIndex)->mDef;
+            if (outQueue.size() == def->nBufferCountActual) {
                 CHECK(handlePortSettingChangeEvent() == true);
                 mPendingSettingChangeEvent = false;
             }
@@ -1120,12 +2484,25 @@ void SoftFFmpegVideo::onQueueFilled(OMX_U32 portIndex) {
 void SoftFFmpegVideo::onPortFlushCompleted(OMX_U32 portIndex) {
     ALOGV("ffmpeg video decoder flush port(%lu)", portIndex);
     if (portIndex == kInputPortIndex && mCtx) {
+        //the worker is idle and empty afterwards, mCtx is ours again
+        flushDecodeThread();
         if (mCtx) {
             //Make sure that the next buffer output does not still
             //depend on fragments from the last one decoded.
             avcodec_flush_buffers(mCtx);
         }
+        clearReplayPackets();
         mEOSStatus = INPUT_DATA_AVAILABLE;
+
+        //start over after a seek
+        mLateUs = 0;
+        mBusyUs = 0;
+        mLastInputTimeUs = -1;
+        mDecStartUs = -1;
+        mDecFrames = 0;
+        if (mCtx && mSkipLevel != 0) {
+            setSkipLevel(0);
+        }
     }
 }
 
@@ -1165,20 +2542,19 @@ void SoftFFmpegVideo::updatePortDefinitions() {
         (def->format.video.nFrameWidth
             * def->format.video.nFrameHeight * 3) / 2;
 
+    //the padding is in nStride and nSliceHeight. adaptive playback and
+    //sys.media.vdec.padframe advertise the padded size as the frame size,
+    //the visible picture is given by OMX_IndexConfigCommonOutputCrop then
+    bool padded = mPaddedFrameSize || mAdaptivePlayback;
     def = &editPortInfo(1)->mDef;
-    def->format.video.nFrameWidth = mWidth;
-    def->format.video.nFrameHeight = mHeight;
-    def->format.video.nStride = def->format.video.nFrameWidth;
-    def->format.video.nSliceHeight = def->format.video.nFrameHeight;
-#if 0
-    def->nBufferSize =
-        (def->format.video.nFrameWidth
-            * def->format.video.nFrameHeight * 3) / 2;
-#else
-    def->nBufferSize =
-        (((def->format.video.nFrameWidth + 15) & -16)
-            * ((def->format.video.nFrameHeight + 15) & -16) * 3) / 2;
-#endif
+    def->format.video.nFrameWidth = padded ? mStride : mWidth;
+    def->format.video.nFrameHeight = padded ? mSliceHeight : mHeight;
+    def->format.video.nStride = mStride;
+    def->format.video.nSliceHeight = mSliceHeight;
+    def->format.video.eColorFormat = mColorFormat;
+    def->nBufferAlignment = mStrideAlign;
+    //stride and slice height are already padded
+    def->nBufferSize = getOutputFrameSize();
 }
 
 }  // namespace android
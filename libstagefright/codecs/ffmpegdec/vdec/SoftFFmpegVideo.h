@@ -20,6 +20,11 @@
 
 #include "SimpleSoftOMXComponent.h"
 
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+#include <pthread.h>
+
 #include "utils/ffmpeg_utils.h"
 
 namespace android {
@@ -39,6 +44,11 @@ protected:
     virtual OMX_ERRORTYPE internalSetParameter(
             OMX_INDEXTYPE index, const OMX_PTR params);
 
+    virtual OMX_ERRORTYPE getExtensionIndex(
+            const char *name, OMX_INDEXTYPE *index);
+
+    virtual OMX_ERRORTYPE getConfig(OMX_INDEXTYPE index, OMX_PTR params);
+
     virtual void onQueueFilled(OMX_U32 portIndex);
     virtual void onPortFlushCompleted(OMX_U32 portIndex);
     virtual void onPortEnableCompleted(OMX_U32 portIndex, bool enabled);
@@ -48,7 +58,7 @@ private:
         kInputPortIndex   = 0,
         kOutputPortIndex  = 1,
         kNumInputBuffers  = 5,
-        kNumOutputBuffers = 2,
+        kNumOutputBuffers = 4,
     };
 
     enum {
@@ -64,6 +74,7 @@ private:
         MODE_FLV1,
         MODE_DIVX,
         MODE_HEVC,
+        MODE_VP9,
         MODE_TRIAL
     } mMode;
 
@@ -81,6 +92,7 @@ private:
 		ERR_CODEC_NOT_FOUND     = -2,
 		ERR_DECODER_OPEN_FAILED = -2,
 		ERR_SWS_FAILED          = -3,
+        ERR_PACKET_LOST         = -4, //packet reference dropped before use
     };
 
     bool mFFmpegAlreadyInited;
@@ -97,7 +109,76 @@ private:
     bool mIgnoreExtradata;
     bool mSignalledError;
     bool mDoDeinterlace;
-    int32_t mWidth, mHeight, mStride;
+    int32_t mWidth, mHeight, mStride, mSliceHeight;
+
+    //adaptive playback: output buffers sized for the largest picture,
+    //size changes below it only update the crop
+    bool mAdaptivePlayback;
+    int32_t mAdaptiveMaxWidth, mAdaptiveMaxHeight;
+
+    //negotiated output colour format, planar or NV12/NV21
+    OMX_COLOR_FORMATTYPE mColorFormat;
+
+    //output buffer count and luma stride alignment, from properties.
+    //1 is no padding, stride and slice height are the picture size
+    int32_t mNumOutputBuffers;
+    int32_t mStrideAlign;
+    //advertise the padded size as the frame size, for renderers which
+    //ignore nStride and nSliceHeight
+    bool mPaddedFrameSize;
+
+    //direct rendering: output buffers handed to ffmpeg as frame buffers,
+    //pinned until ffmpeg drops its last reference to them. pins are the
+    //buffers' data, the client may free a header before ffmpeg lets go.
+    //the demuxer's packets since the last keyframe are shared to bring
+    //the decoder back after it had to be flushed to drop its references,
+    //see dropDirectRendering. without them it waits for a keyframe.
+    bool mDirectRendering;
+    Mutex mDRLock;
+    Vector<uint8_t *> mDRPinned;
+    List<AVPacket *> mDRReplay;
+    bool mDRReplayValid;
+    bool mWaitKeyFrame;
+
+    //scratch pictures for deinterlacing ahead of a real conversion
+    AVBufferPool *mScratchPool;
+    int mScratchSize;
+
+    int64_t mConvTimeUs;
+    uint32_t mConvFrames;
+
+    //adaptive frame skipping
+    bool mSkipEnabled;
+    int mSkipLevel;
+    int mSkipFrames;
+    int64_t mLateUs;
+    int64_t mBusyUs;
+    int64_t mLastInputTimeUs;
+
+    //requested downscale factor, and what is left of it for swscale
+    //after the decoder's own lowres
+    int mLowres;
+    int mDownscale;
+
+    //decoding throughput, see DEBUG_DEC
+    int64_t mDecStartUs;
+    int64_t mDecFrames;
+
+    //decode worker: packets copied out of the input buffers go in,
+    //decoded frames come out. it never owns an OMX buffer, the queues
+    //and all callbacks stay on the OMX thread. mCtx belongs to the
+    //worker while mDecodeBusy is set.
+    bool mAsyncDecode;
+    bool mDecodeThreadStarted;
+    pthread_t mDecodeThread;
+    Mutex mDecodeLock;
+    Condition mDecodeCond;      //signalled to the worker
+    Condition mReadyCond;       //signalled to the OMX thread
+    List<AVPacket *> mDecodePackets;
+    List<AVFrame *> mReadyFrames;
+    bool mDecodeBusy;
+    bool mDecodeDrained;
+    bool mStopDecode;
 
     enum {
         NONE,
@@ -109,25 +190,66 @@ private:
     void     initInputFormat(uint32_t mode, OMX_PARAM_PORTDEFINITIONTYPE &def);
 	void     getInputFormat(uint32_t mode, OMX_VIDEO_PARAM_PORTFORMATTYPE *formatParams);
     void     setDefaultCtx(AVCodecContext *avctx, const AVCodec *codec);
+    void     setThreadCtx(AVCodecContext *avctx);
     OMX_ERRORTYPE isRoleSupported(const OMX_PARAM_COMPONENTROLETYPE *roleParams);
 
     void     initPorts();
     status_t initDecoder();
     void     deInitDecoder();
 
+    void     getOutputSize(int32_t *width, int32_t *height);
+    void     updateOutputSize();
+    void     updateBufferGeometry();
+    int32_t  getSliceHeightAlign();
+    bool     isCropOnlyChange();
+    AVPixelFormat getOutputPixelFormat();
+    void     fillOutputPicture(AVPicture *pict, uint8_t *dst);
+    size_t   getOutputFrameSize();
     bool     isPortSettingChanged();
 	bool     handlePortSettingChangeEvent();
 	int32_t  handleExtradata();
 	int32_t  openDecoder();
-    void     initPacket(AVPacket *pkt, OMX_BUFFERHEADERTYPE *inHeader);
+    int32_t  initPacket(AVPacket *pkt, OMX_BUFFERHEADERTYPE *inHeader);
     int32_t  decodeVideo();
-    int32_t  preProcessVideoFrame(AVPicture *picture, void **bufp);
+    void     updateDecodeStats();
+    void     updateSkipLevel(int64_t timeUs);
+    void     setSkipLevel(int level);
+    int32_t  preProcessVideoFrame(AVPicture *picture, AVBufferRef **bufp);
+    static int  GetBufferWrapper(AVCodecContext *avctx,
+                                 AVFrame *frame, int flags);
+    static void ReleaseBufferWrapper(void *opaque, uint8_t *data);
+    int      getBuffer(AVCodecContext *avctx, AVFrame *frame, int flags);
+    void     releaseBuffer(uint8_t *data);
+    bool     canDirectRender(AVCodecContext *avctx, AVFrame *frame, int *align);
+    OMX_BUFFERHEADERTYPE *pinOutputBuffer(size_t size, int align);
+    bool     isPinned(uint8_t *data);
+    bool     hasPinnedOutputBuffers();
+    bool     hasStalePins();
+    void     keepReplayPacket(const AVPacket *pkt);
+    void     clearReplayPackets();
+    void     dropDirectRendering(const AVFrame *keep);
+    bool     isDirectRendered(AVFrame *frame);
+    List<BufferInfo *>::iterator findOutputBuffer(uint8_t *data);
+    List<BufferInfo *>::iterator findFreeOutputBuffer();
+    bool     isOutputBufferAvailable();
+
+    int32_t  convertFrame(uint8_t *dst);
 	int32_t  drainOneOutputBuffer();
 	void     drainEOSOutputBuffer();
 	void     drainAllOutputBuffers();
 
     void     updatePortDefinitions();
 
+    status_t startDecodeThread();
+    void     stopDecodeThread();
+    void     flushDecodeThread();
+    void     clearDecodeQueues();
+    static void *DecodeThreadWrapper(void *me);
+    void     decodeThreadEntry();
+    int32_t  queueDecodePackets();
+    int32_t  takeReadyFrame(bool wait);
+    void     processQueuesAsync();
+
     DISALLOW_EVIL_CONSTRUCTORS(SoftFFmpegVideo);
 };
 
@@ -7,7 +7,12 @@ LOCAL_SRC_FILES := \
 	ffmpeg_source.cpp \
 	ffmpeg_utils.cpp \
 	ffmpeg_cmdutils.c \
-	codec_utils.cpp
+	codec_utils.cpp \
+	codec_pool.cpp \
+	packet_ref.cpp \
+	video_utils.cpp \
+	audio_utils.cpp \
+	spdif_packer.cpp
 
 LOCAL_C_INCLUDES += \
 	$(TOP)/frameworks/native/include/media/openmax \
@@ -0,0 +1,461 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "audio_utils"
+#include <utils/Log.h>
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/cpu.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNELS 1
+#endif
+
+#include "audio_utils.h"
+
+namespace android {
+
+typedef void (*flt_s16_1_fn)(int16_t *dst, const float *src, int n);
+typedef void (*flt_s16_2_fn)(int16_t *dst,
+        const float *src_l, const float *src_r, int n);
+typedef void (*s32_s16_1_fn)(int16_t *dst, const int32_t *src, int n);
+typedef void (*s32_s16_2_fn)(int16_t *dst,
+        const int32_t *src_l, const int32_t *src_r, int n);
+typedef void (*downmix_51_fn)(int16_t *dst, const float * const *src, int n);
+typedef void (*flt_flt_2_fn)(float *dst,
+        const float *src_l, const float *src_r, int n);
+
+//5.1 to stereo downmix coefficients, see init_kernels()
+static float s_front;
+static float s_center;
+static float s_surround;
+
+//////////////////////////////////////////////////////////////////////////////////
+// c
+//////////////////////////////////////////////////////////////////////////////////
+
+//av_clip_int16(lrintf(v * 32768)), clipping first keeps lrintf in range
+static inline int16_t flt_to_s16(float v) {
+    v *= 32768.0f;
+    if (v >= 32767.0f) {
+        return 32767;
+    } else if (v <= -32768.0f) {
+        return -32768;
+    }
+    return (int16_t)lrintf(v);
+}
+
+static void flt_s16_1_c(int16_t *dst, const float *src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = flt_to_s16(src[i]);
+    }
+}
+
+static void flt_s16_2_c(int16_t *dst,
+        const float *src_l, const float *src_r, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[2 * i]     = flt_to_s16(src_l[i]);
+        dst[2 * i + 1] = flt_to_s16(src_r[i]);
+    }
+}
+
+static void s32_s16_1_c(int16_t *dst, const int32_t *src, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = src[i] >> 16;
+    }
+}
+
+static void s32_s16_2_c(int16_t *dst,
+        const int32_t *src_l, const int32_t *src_r, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[2 * i]     = src_l[i] >> 16;
+        dst[2 * i + 1] = src_r[i] >> 16;
+    }
+}
+
+static void flt_flt_2_c(float *dst,
+        const float *src_l, const float *src_r, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[2 * i]     = src_l[i];
+        dst[2 * i + 1] = src_r[i];
+    }
+}
+
+//summed in the order of swresample's rematrix, one rounding per step
+static void downmix_51_c(int16_t *dst, const float * const *src, int n) {
+    for (int i = 0; i < n; i++) {
+        float l = src[0][i] * s_front;
+        float r = src[1][i] * s_front;
+        l += src[2][i] * s_center;
+        r += src[2][i] * s_center;
+        l += src[4][i] * s_surround;
+        r += src[5][i] * s_surround;
+        dst[2 * i]     = flt_to_s16(l);
+        dst[2 * i + 1] = flt_to_s16(r);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// neon
+//////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_NEON_KERNELS
+//scale, clip and round to nearest even. armv7 neon only converts with
+//truncation, so add 1.5 * 2^23: the sum is rounded like lrintf and
+//leaves the integer in the low mantissa bits.
+static inline int32x4_t flt_to_s32_neon(float32x4_t v) {
+    v = vmulq_f32(v, vdupq_n_f32(32768.0f));
+    v = vmaxq_f32(v, vdupq_n_f32(-32768.0f));
+    v = vminq_f32(v, vdupq_n_f32(32767.0f));
+    v = vaddq_f32(v, vdupq_n_f32(12582912.0f));
+    return vsubq_s32(vreinterpretq_s32_f32(v), vdupq_n_s32(0x4B400000));
+}
+
+static inline int16x8_t flt_to_s16_neon(float32x4_t a, float32x4_t b) {
+    return vcombine_s16(vmovn_s32(flt_to_s32_neon(a)),
+                        vmovn_s32(flt_to_s32_neon(b)));
+}
+
+static void flt_s16_1_neon(int16_t *dst, const float *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        vst1q_s16(dst + i, flt_to_s16_neon(vld1q_f32(src + i),
+                                           vld1q_f32(src + i + 4)));
+    }
+    flt_s16_1_c(dst + i, src + i, n - i);
+}
+
+static void flt_s16_2_neon(int16_t *dst,
+        const float *src_l, const float *src_r, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8x2_t lr;
+        lr.val[0] = flt_to_s16_neon(vld1q_f32(src_l + i), vld1q_f32(src_l + i + 4));
+        lr.val[1] = flt_to_s16_neon(vld1q_f32(src_r + i), vld1q_f32(src_r + i + 4));
+        vst2q_s16(dst + 2 * i, lr);
+    }
+    flt_s16_2_c(dst + 2 * i, src_l + i, src_r + i, n - i);
+}
+
+static void s32_s16_1_neon(int16_t *dst, const int32_t *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(vld1q_s32(src + i), 16),
+                                        vshrn_n_s32(vld1q_s32(src + i + 4), 16)));
+    }
+    s32_s16_1_c(dst + i, src + i, n - i);
+}
+
+static void s32_s16_2_neon(int16_t *dst,
+        const int32_t *src_l, const int32_t *src_r, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8x2_t lr;
+        lr.val[0] = vcombine_s16(vshrn_n_s32(vld1q_s32(src_l + i), 16),
+                                 vshrn_n_s32(vld1q_s32(src_l + i + 4), 16));
+        lr.val[1] = vcombine_s16(vshrn_n_s32(vld1q_s32(src_r + i), 16),
+                                 vshrn_n_s32(vld1q_s32(src_r + i + 4), 16));
+        vst2q_s16(dst + 2 * i, lr);
+    }
+    s32_s16_2_c(dst + 2 * i, src_l + i, src_r + i, n - i);
+}
+
+static void flt_flt_2_neon(float *dst,
+        const float *src_l, const float *src_r, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4x2_t lr;
+        lr.val[0] = vld1q_f32(src_l + i);
+        lr.val[1] = vld1q_f32(src_r + i);
+        vst2q_f32(dst + 2 * i, lr);
+    }
+    flt_flt_2_c(dst + 2 * i, src_l + i, src_r + i, n - i);
+}
+
+//no vmla, a fused or chained multiply-add would round differently
+static void downmix_51_neon(int16_t *dst, const float * const *src, int n) {
+    const float32x4_t front = vdupq_n_f32(s_front);
+    const float32x4_t center = vdupq_n_f32(s_center);
+    const float32x4_t surround = vdupq_n_f32(s_surround);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t c = vmulq_f32(vld1q_f32(src[2] + i), center);
+        float32x4_t l = vmulq_f32(vld1q_f32(src[0] + i), front);
+        float32x4_t r = vmulq_f32(vld1q_f32(src[1] + i), front);
+        l = vaddq_f32(l, c);
+        r = vaddq_f32(r, c);
+        l = vaddq_f32(l, vmulq_f32(vld1q_f32(src[4] + i), surround));
+        r = vaddq_f32(r, vmulq_f32(vld1q_f32(src[5] + i), surround));
+        int16x4x2_t lr;
+        lr.val[0] = vmovn_s32(flt_to_s32_neon(l));
+        lr.val[1] = vmovn_s32(flt_to_s32_neon(r));
+        vst2_s16(dst + 2 * i, lr);
+    }
+    if (i < n) {
+        const float *rest[6];
+        for (int ch = 0; ch < 6; ch++) {
+            rest[ch] = src[ch] + i;
+        }
+        downmix_51_c(dst + 2 * i, rest, n - i);
+    }
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// sse2
+//////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_SSE2_KERNELS
+//cvtps2dq rounds to nearest even like lrintf in the default mxcsr mode
+static inline __m128i flt_to_s32_sse2(__m128 v) {
+    v = _mm_mul_ps(v, _mm_set1_ps(32768.0f));
+    v = _mm_max_ps(v, _mm_set1_ps(-32768.0f));
+    v = _mm_min_ps(v, _mm_set1_ps(32767.0f));
+    return _mm_cvtps_epi32(v);
+}
+
+static inline __m128i flt_to_s16_sse2(__m128 a, __m128 b) {
+    return _mm_packs_epi32(flt_to_s32_sse2(a), flt_to_s32_sse2(b));
+}
+
+static void flt_s16_1_sse2(int16_t *dst, const float *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(dst + i),
+                flt_to_s16_sse2(_mm_loadu_ps(src + i), _mm_loadu_ps(src + i + 4)));
+    }
+    flt_s16_1_c(dst + i, src + i, n - i);
+}
+
+static void flt_s16_2_sse2(int16_t *dst,
+        const float *src_l, const float *src_r, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i l = flt_to_s16_sse2(_mm_loadu_ps(src_l + i), _mm_loadu_ps(src_l + i + 4));
+        __m128i r = flt_to_s16_sse2(_mm_loadu_ps(src_r + i), _mm_loadu_ps(src_r + i + 4));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+    }
+    flt_s16_2_c(dst + 2 * i, src_l + i, src_r + i, n - i);
+}
+
+static inline __m128i s32_to_s16_sse2(const int32_t *src) {
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)src), 16);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 4)), 16);
+    return _mm_packs_epi32(a, b);
+}
+
+static void s32_s16_1_sse2(int16_t *dst, const int32_t *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(dst + i), s32_to_s16_sse2(src + i));
+    }
+    s32_s16_1_c(dst + i, src + i, n - i);
+}
+
+static void s32_s16_2_sse2(int16_t *dst,
+        const int32_t *src_l, const int32_t *src_r, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i l = s32_to_s16_sse2(src_l + i);
+        __m128i r = s32_to_s16_sse2(src_r + i);
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+    }
+    s32_s16_2_c(dst + 2 * i, src_l + i, src_r + i, n - i);
+}
+
+static void flt_flt_2_sse2(float *dst,
+        const float *src_l, const float *src_r, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 l = _mm_loadu_ps(src_l + i);
+        __m128 r = _mm_loadu_ps(src_r + i);
+        _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
+    }
+    flt_flt_2_c(dst + 2 * i, src_l + i, src_r + i, n - i);
+}
+
+static void downmix_51_sse2(int16_t *dst, const float * const *src, int n) {
+    const __m128 front = _mm_set1_ps(s_front);
+    const __m128 center = _mm_set1_ps(s_center);
+    const __m128 surround = _mm_set1_ps(s_surround);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lr[2];
+        for (int k = 0; k < 2; k++) {
+            int j = i + 4 * k;
+            __m128 c = _mm_mul_ps(_mm_loadu_ps(src[2] + j), center);
+            __m128 l = _mm_mul_ps(_mm_loadu_ps(src[0] + j), front);
+            __m128 r = _mm_mul_ps(_mm_loadu_ps(src[1] + j), front);
+            l = _mm_add_ps(l, c);
+            r = _mm_add_ps(r, c);
+            l = _mm_add_ps(l, _mm_mul_ps(_mm_loadu_ps(src[4] + j), surround));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(src[5] + j), surround));
+            //l0 r0 l1 r1 l2 r2 l3 r3 after the pack
+            __m128i l32 = flt_to_s32_sse2(l);
+            __m128i r32 = flt_to_s32_sse2(r);
+            lr[k] = _mm_packs_epi32(_mm_unpacklo_epi32(l32, r32),
+                                    _mm_unpackhi_epi32(l32, r32));
+        }
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), lr[0]);
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), lr[1]);
+    }
+    if (i < n) {
+        const float *rest[6];
+        for (int ch = 0; ch < 6; ch++) {
+            rest[ch] = src[ch] + i;
+        }
+        downmix_51_c(dst + 2 * i, rest, n - i);
+    }
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// dispatch
+//////////////////////////////////////////////////////////////////////////////////
+
+static pthread_once_t s_kernels_once = PTHREAD_ONCE_INIT;
+static flt_s16_1_fn  s_flt_s16_1  = flt_s16_1_c;
+static flt_s16_2_fn  s_flt_s16_2  = flt_s16_2_c;
+static s32_s16_1_fn  s_s32_s16_1  = s32_s16_1_c;
+static s32_s16_2_fn  s_s32_s16_2  = s32_s16_2_c;
+static downmix_51_fn s_downmix_51 = downmix_51_c;
+static flt_flt_2_fn  s_flt_flt_2  = flt_flt_2_c;
+static const char   *s_kernels_name = "c";
+
+static void init_kernels() {
+    int flags = av_get_cpu_flags();
+
+    //what swresample builds for 5.1 to stereo with its defaults: centre
+    //and surround at -3dB, the rows scaled down to a sum of 1 for integer
+    //output, computed in double and used as float
+    double center = M_SQRT1_2;
+    double surround = M_SQRT1_2;
+    double maxcoef = 1.0 + center + surround;
+    s_front    = (float)(1.0 / maxcoef);
+    s_center   = (float)(center / maxcoef);
+    s_surround = (float)(surround / maxcoef);
+
+#if HAVE_NEON_KERNELS
+    if (flags & AV_CPU_FLAG_NEON) {
+        s_flt_s16_1  = flt_s16_1_neon;
+        s_flt_s16_2  = flt_s16_2_neon;
+        s_s32_s16_1  = s32_s16_1_neon;
+        s_s32_s16_2  = s32_s16_2_neon;
+        s_downmix_51 = downmix_51_neon;
+        s_flt_flt_2  = flt_flt_2_neon;
+        s_kernels_name = "neon";
+    }
+#endif
+#if HAVE_SSE2_KERNELS
+    if (flags & AV_CPU_FLAG_SSE2) {
+        s_flt_s16_1  = flt_s16_1_sse2;
+        s_flt_s16_2  = flt_s16_2_sse2;
+        s_s32_s16_1  = s32_s16_1_sse2;
+        s_s32_s16_2  = s32_s16_2_sse2;
+        s_downmix_51 = downmix_51_sse2;
+        s_flt_flt_2  = flt_flt_2_sse2;
+        s_kernels_name = "sse2";
+    }
+#endif
+    (void)flags;
+
+    ALOGI("audio kernels: %s", s_kernels_name);
+}
+
+void fltp_to_s16(int16_t *dst, const float * const *src,
+        int channels, int nb_samples) {
+    pthread_once(&s_kernels_once, init_kernels);
+
+    if (channels == 1) {
+        s_flt_s16_1(dst, src[0], nb_samples);
+    } else if (channels == 2) {
+        s_flt_s16_2(dst, src[0], src[1], nb_samples);
+    } else {
+        for (int i = 0; i < nb_samples; i++) {
+            for (int ch = 0; ch < channels; ch++) {
+                *dst++ = flt_to_s16(src[ch][i]);
+            }
+        }
+    }
+}
+
+void s32p_to_s16(int16_t *dst, const int32_t * const *src,
+        int channels, int nb_samples) {
+    pthread_once(&s_kernels_once, init_kernels);
+
+    if (channels == 1) {
+        s_s32_s16_1(dst, src[0], nb_samples);
+    } else if (channels == 2) {
+        s_s32_s16_2(dst, src[0], src[1], nb_samples);
+    } else {
+        for (int i = 0; i < nb_samples; i++) {
+            for (int ch = 0; ch < channels; ch++) {
+                *dst++ = src[ch][i] >> 16;
+            }
+        }
+    }
+}
+
+void fltp_51_to_s16_stereo(int16_t *dst, const float * const *src,
+        int nb_samples) {
+    pthread_once(&s_kernels_once, init_kernels);
+    s_downmix_51(dst, src, nb_samples);
+}
+
+void fltp_to_flt(float *dst, const float * const *src,
+        int channels, int nb_samples) {
+    pthread_once(&s_kernels_once, init_kernels);
+
+    if (channels == 1) {
+        memcpy(dst, src[0], nb_samples * sizeof(float));
+    } else if (channels == 2) {
+        s_flt_flt_2(dst, src[0], src[1], nb_samples);
+    } else {
+        for (int i = 0; i < nb_samples; i++) {
+            for (int ch = 0; ch < channels; ch++) {
+                *dst++ = src[ch][i];
+            }
+        }
+    }
+}
+
+const char *audio_kernels_name() {
+    pthread_once(&s_kernels_once, init_kernels);
+    return s_kernels_name;
+}
+
+}  // namespace android
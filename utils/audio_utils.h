@@ -0,0 +1,55 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_UTILS_H_
+
+#define AUDIO_UTILS_H_
+
+#include <stdint.h>
+
+namespace android {
+
+//////////////////////////////////////////////////////////////////////////////////
+// sample conversion to interleaved s16 or float, the kernels are picked at
+// runtime by cpu flags (NEON/SSE2). The results are those of the C code of
+// swresample for the same conversion: floats are scaled by 32768, rounded
+// to nearest even and clipped, 32-bit integers are shifted right by 16.
+//////////////////////////////////////////////////////////////////////////////////
+
+//planar float, any number of channels
+void fltp_to_s16(int16_t *dst, const float * const *src,
+        int channels, int nb_samples);
+
+//planar 32-bit, any number of channels
+void s32p_to_s16(int16_t *dst, const int32_t * const *src,
+        int channels, int nb_samples);
+
+//planar float 5.1 (FL FR FC LFE SL/BL SR/BR) downmixed to stereo with
+//swresample's default matrix, i.e. centre and surround at -3dB, no LFE,
+//normalized so that nothing clips which did not clip before
+void fltp_51_to_s16_stereo(int16_t *dst, const float * const *src,
+        int nb_samples);
+
+//planar float interleaved, no conversion, any number of channels
+void fltp_to_flt(float *dst, const float * const *src,
+        int channels, int nb_samples);
+
+//name of the kernel set in use, for logging
+const char *audio_kernels_name();
+
+}  // namespace android
+
+#endif  // AUDIO_UTILS_H_
@@ -0,0 +1,312 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "codec_pool"
+#include <utils/Log.h>
+
+#include <utils/Vector.h>
+#include <cutils/properties.h>
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/adler32.h"
+#include "libavutil/time.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "codec_pool.h"
+
+namespace android {
+
+//idle contexts kept by default, and at most
+static const int kDefaultPoolSize = 2;
+static const int kMaxPoolSize = 8;
+//an idle context nobody asked for in this time is closed
+static const int64_t kMaxIdleUs = 30000000LL;
+
+//everything a decoder may look at in avcodec_open2()
+typedef struct CodecPoolKey {
+    enum AVCodecID codec_id;
+    unsigned int codec_tag;
+    unsigned long extradata_hash;
+    int extradata_size;
+    int channels;
+    int sample_rate;
+    int block_align;
+    int bits_per_coded_sample;
+    int64_t bit_rate;
+    uint64_t channel_layout;
+    enum AVSampleFormat request_sample_fmt;
+    uint64_t request_channel_layout;
+    int thread_count;
+    int thread_type;
+    int flavour;
+} CodecPoolKey;
+
+typedef struct CodecPoolEntry {
+    AVCodecContext *avctx;
+    CodecPoolKey key;
+    int64_t idle_since_us;
+} CodecPoolEntry;
+
+static pthread_mutex_t s_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Vector<CodecPoolEntry> s_idle;      //oldest first
+static Vector<CodecPoolEntry> s_in_use;    //opened through the pool, with their keys
+static CodecPoolStats s_stats;
+
+static int pool_size()
+{
+    char value[PROPERTY_VALUE_MAX];
+    int size;
+
+    property_get("sys.media.codec.pool", value, "-1");
+    size = atoi(value);
+    if (size < 0)
+        return kDefaultPoolSize;
+    return size > kMaxPoolSize ? kMaxPoolSize : size;
+}
+
+static void make_key(CodecPoolKey *key, const AVCodecContext *avctx, int flavour)
+{
+    memset(key, 0, sizeof(*key));
+    key->codec_id               = avctx->codec_id;
+    key->codec_tag              = avctx->codec_tag;
+    key->extradata_size         = avctx->extradata ? avctx->extradata_size : 0;
+    key->extradata_hash         = av_adler32_update(1, avctx->extradata,
+                                          key->extradata_size);
+    key->channels               = avctx->channels;
+    key->sample_rate            = avctx->sample_rate;
+    key->block_align            = avctx->block_align;
+    key->bits_per_coded_sample  = avctx->bits_per_coded_sample;
+    key->bit_rate               = avctx->bit_rate;
+    key->channel_layout         = avctx->channel_layout;
+    key->request_sample_fmt     = avctx->request_sample_fmt;
+    key->request_channel_layout = avctx->request_channel_layout;
+    key->thread_count           = avctx->thread_count;
+    key->thread_type            = avctx->thread_type;
+    key->flavour                = flavour;
+}
+
+static bool key_equal(const CodecPoolKey *a, const CodecPoolKey *b)
+{
+    return a->codec_id == b->codec_id
+        && a->codec_tag == b->codec_tag
+        && a->extradata_hash == b->extradata_hash
+        && a->extradata_size == b->extradata_size
+        && a->channels == b->channels
+        && a->sample_rate == b->sample_rate
+        && a->block_align == b->block_align
+        && a->bits_per_coded_sample == b->bits_per_coded_sample
+        && a->bit_rate == b->bit_rate
+        && a->channel_layout == b->channel_layout
+        && a->request_sample_fmt == b->request_sample_fmt
+        && a->request_channel_layout == b->request_channel_layout
+        && a->thread_count == b->thread_count
+        && a->thread_type == b->thread_type
+        && a->flavour == b->flavour;
+}
+
+//the hash only rules out, the extradata itself decides
+static bool extradata_equal(const AVCodecContext *a, const AVCodecContext *b)
+{
+    int size = a->extradata ? a->extradata_size : 0;
+
+    return size == (b->extradata ? b->extradata_size : 0)
+        && (size == 0 || !memcmp(a->extradata, b->extradata, size));
+}
+
+//whatever the caller set up for decoding, as opposed to the stream
+//parameters in the key which the warm decoder was opened with
+static void take_user_settings(AVCodecContext *dst, const AVCodecContext *src)
+{
+    dst->opaque            = src->opaque;
+    dst->get_buffer2       = src->get_buffer2;
+    dst->refcounted_frames = src->refcounted_frames;
+    dst->workaround_bugs   = src->workaround_bugs;
+    dst->error_concealment = src->error_concealment;
+    dst->skip_frame        = src->skip_frame;
+    dst->skip_idct         = src->skip_idct;
+    dst->skip_loop_filter  = src->skip_loop_filter;
+    dst->flags2            = src->flags2;
+    dst->debug             = src->debug;
+}
+
+//drop the idle contexts beyond max or idle for too long, oldest first.
+//closing may join decoder threads, so the caller does it unlocked.
+static void take_expired_locked(int64_t now_us, size_t max,
+        Vector<AVCodecContext *> *victims)
+{
+    while (!s_idle.isEmpty() && (s_idle.size() > max
+                || now_us - s_idle[0].idle_since_us > kMaxIdleUs)) {
+        victims->push(s_idle[0].avctx);
+        s_idle.removeAt(0);
+        s_stats.evictions++;
+    }
+}
+
+static void free_victims(Vector<AVCodecContext *> *victims)
+{
+    for (size_t i = 0; i < victims->size(); i++) {
+        AVCodecContext *avctx = victims->itemAt(i);
+        codec_pool_free_context(&avctx);
+    }
+    victims->clear();
+}
+
+static bool forget_locked(AVCodecContext *avctx, CodecPoolEntry *entry)
+{
+    for (size_t i = 0; i < s_in_use.size(); i++) {
+        if (s_in_use[i].avctx == avctx) {
+            if (entry)
+                *entry = s_in_use[i];
+            s_in_use.removeAt(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+int codec_pool_open(AVCodecContext **avctx, const AVCodec *codec, int flavour)
+{
+    AVCodecContext *ctx = *avctx;
+    Vector<AVCodecContext *> victims;
+    CodecPoolEntry entry;
+    int64_t start_us = av_gettime();
+    int64_t elapsed_us;
+    bool warm;
+    int ret;
+
+    make_key(&entry.key, ctx, flavour);
+    entry.avctx = NULL;
+    entry.idle_since_us = 0;
+
+    pthread_mutex_lock(&s_pool_mutex);
+    take_expired_locked(start_us, kMaxPoolSize, &victims);
+    for (size_t i = 0; i < s_idle.size(); i++) {
+        if (key_equal(&s_idle[i].key, &entry.key)
+                && s_idle[i].avctx->codec == codec
+                && extradata_equal(s_idle[i].avctx, ctx)) {
+            entry.avctx = s_idle[i].avctx;
+            s_idle.removeAt(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_pool_mutex);
+
+    free_victims(&victims);
+
+    warm = entry.avctx != NULL;
+    if (warm) {
+        take_user_settings(entry.avctx, ctx);
+        codec_pool_free_context(&ctx);
+        *avctx = entry.avctx;
+    } else {
+        ret = avcodec_open2(ctx, codec, NULL);
+        if (ret < 0)
+            return ret;
+        entry.avctx = ctx;
+    }
+    elapsed_us = av_gettime() - start_us;
+
+    pthread_mutex_lock(&s_pool_mutex);
+    s_in_use.push(entry);
+    if (warm) {
+        s_stats.hits++;
+        s_stats.warm_open_us += elapsed_us;
+    } else {
+        s_stats.misses++;
+        s_stats.cold_open_us += elapsed_us;
+    }
+    ALOGD("%s open of %s in %lld us (hits: %d, misses: %d, evictions: %d, "
+            "avg cold: %lld us, avg warm: %lld us)",
+            warm ? "warm" : "cold", avcodec_get_name(codec->id),
+            elapsed_us, s_stats.hits, s_stats.misses, s_stats.evictions,
+            s_stats.misses ? s_stats.cold_open_us / s_stats.misses : 0LL,
+            s_stats.hits ? s_stats.warm_open_us / s_stats.hits : 0LL);
+    pthread_mutex_unlock(&s_pool_mutex);
+
+    return 0;
+}
+
+void codec_pool_close(AVCodecContext **avctx)
+{
+    AVCodecContext *ctx = *avctx;
+    Vector<AVCodecContext *> victims;
+    CodecPoolEntry entry;
+    int size = pool_size();
+    bool found;
+
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&s_pool_mutex);
+    found = forget_locked(ctx, &entry);
+    pthread_mutex_unlock(&s_pool_mutex);
+
+    if (!found || size == 0 || !avcodec_is_open(ctx)) {
+        codec_pool_free_context(avctx);
+        return;
+    }
+    *avctx = NULL;
+
+    //start the next owner from a clean decoder, and never call back
+    //into the old one
+    avcodec_flush_buffers(ctx);
+    ctx->opaque      = NULL;
+    ctx->get_buffer2 = avcodec_default_get_buffer2;
+
+    entry.idle_since_us = av_gettime();
+
+    pthread_mutex_lock(&s_pool_mutex);
+    s_idle.push(entry);
+    take_expired_locked(entry.idle_since_us, size, &victims);
+    pthread_mutex_unlock(&s_pool_mutex);
+
+    free_victims(&victims);
+}
+
+void codec_pool_free_context(AVCodecContext **avctx)
+{
+    AVCodecContext *ctx = *avctx;
+
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&s_pool_mutex);
+    forget_locked(ctx, NULL);
+    pthread_mutex_unlock(&s_pool_mutex);
+
+    avcodec_close(ctx);
+    av_freep(&ctx->extradata);
+    ctx->extradata_size = 0;
+    av_freep(avctx);
+}
+
+void codec_pool_get_stats(CodecPoolStats *stats)
+{
+    pthread_mutex_lock(&s_pool_mutex);
+    *stats = s_stats;
+    pthread_mutex_unlock(&s_pool_mutex);
+}
+
+}  // namespace android
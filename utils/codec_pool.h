@@ -0,0 +1,61 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_POOL_H_
+
+#define CODEC_POOL_H_
+
+#include "ffmpeg_utils.h"
+
+namespace android {
+
+//////////////////////////////////////////////////////////////////////////////////
+// warm decoder pool
+//
+// Decoder contexts closed by one component are flushed and kept for a
+// while, the next component opening the same stream (codec id, tag,
+// extradata, audio parameters and a caller flavour such as lowres) gets
+// one of them instead of paying avcodec_open2() again.
+// setprop sys.media.codec.pool N keeps up to N idle contexts, 0 disables it.
+//////////////////////////////////////////////////////////////////////////////////
+
+typedef struct CodecPoolStats {
+    int hits;
+    int misses;
+    int evictions;
+    int64_t cold_open_us;   //total time spent in avcodec_open2()
+    int64_t warm_open_us;   //total time spent taking warm contexts
+} CodecPoolStats;
+
+//open *avctx with codec, or swap it for a warm context of the same stream.
+//on a hit the caller's context is freed and *avctx replaced, the caller's
+//callbacks and decoding options are carried over. returns avcodec_open2()'s
+//result.
+int codec_pool_open(AVCodecContext **avctx, const AVCodec *codec, int flavour);
+
+//flush *avctx and keep it for a later codec_pool_open(), or free it.
+//*avctx is NULL afterwards. the caller must not let any frame buffer
+//reference its own memory past this call.
+void codec_pool_close(AVCodecContext **avctx);
+
+//close and free *avctx and its extradata, it is never kept
+void codec_pool_free_context(AVCodecContext **avctx);
+
+void codec_pool_get_stats(CodecPoolStats *stats);
+
+}  // namespace android
+
+#endif  // CODEC_POOL_H_
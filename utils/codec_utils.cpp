@@ -283,6 +283,20 @@ sp<MetaData> setHEVCFormat(AVCodecContext *avctx)
     return meta;
 }
 
+sp<MetaData> setVP9Format(AVCodecContext *avctx)
+{
+    ALOGV("VP9");
+
+    sp<MetaData> meta = new MetaData;
+    meta->setCString(kKeyMIMEType, FFMPEG_MIMETYPE_VIDEO_VP9);
+    //webm carries no codec private data for vp9
+    if (avctx->extradata_size > 0) {
+        meta->setData(kKeyRawCodecSpecificData, 0, avctx->extradata, avctx->extradata_size);
+    }
+
+    return meta;
+}
+
 //audio
 
 sp<MetaData> setMP2Format(AVCodecContext *avctx)
@@ -462,6 +476,304 @@ sp<MetaData> setFLACFormat(AVCodecContext *avctx)
     return meta;
 }
 
+//HEVC parameter sets
+
+//minimal bit reader for parameter sets, reads zeros past the end
+typedef struct NALBitReader {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;     //in bits
+} NALBitReader;
+
+static uint32_t nalGetBits(NALBitReader *br, int n)
+{
+    uint32_t val = 0;
+
+    while (n-- > 0) {
+        size_t byte = br->pos >> 3;
+        int bit = byte < br->size ? (br->data[byte] >> (7 - (br->pos & 7))) & 1 : 0;
+        val = (val << 1) | bit;
+        br->pos++;
+    }
+    return val;
+}
+
+static uint32_t nalGetUE(NALBitReader *br)
+{
+    int zeros = 0;
+
+    while (!nalGetBits(br, 1)) {
+        if (++zeros > 31) {
+            return 0;
+        }
+    }
+    return ((1u << zeros) - 1) + nalGetBits(br, zeros);
+}
+
+static void parseHEVCPPS(const uint8_t *nal, size_t size, bool *tiles, bool *wpp)
+{
+    //the flags are within the first few bytes, unescape just those
+    uint8_t rbsp[64];
+    size_t len = 0;
+    NALBitReader br;
+
+    //skip the two byte nal unit header
+    for (size_t i = 2; i < size && len < sizeof(rbsp); i++) {
+        if (i >= 4 && nal[i] == 3 && nal[i - 1] == 0 && nal[i - 2] == 0) {
+            continue;
+        }
+        rbsp[len++] = nal[i];
+    }
+
+    br.data = rbsp;
+    br.size = len;
+    br.pos = 0;
+
+    nalGetUE(&br);          //pps_pic_parameter_set_id
+    nalGetUE(&br);          //pps_seq_parameter_set_id
+    nalGetBits(&br, 1);     //dependent_slice_segments_enabled_flag
+    nalGetBits(&br, 1);     //output_flag_present_flag
+    nalGetBits(&br, 3);     //num_extra_slice_header_bits
+    nalGetBits(&br, 1);     //sign_data_hiding_enabled_flag
+    nalGetBits(&br, 1);     //cabac_init_present_flag
+    nalGetUE(&br);          //num_ref_idx_l0_default_active_minus1
+    nalGetUE(&br);          //num_ref_idx_l1_default_active_minus1
+    nalGetUE(&br);          //init_qp_minus26, se(v) is as long as ue(v)
+    nalGetBits(&br, 1);     //constrained_intra_pred_flag
+    nalGetBits(&br, 1);     //transform_skip_enabled_flag
+    if (nalGetBits(&br, 1)) //cu_qp_delta_enabled_flag
+        nalGetUE(&br);      //diff_cu_qp_delta_depth
+    nalGetUE(&br);          //pps_cb_qp_offset
+    nalGetUE(&br);          //pps_cr_qp_offset
+    nalGetBits(&br, 1);     //pps_slice_chroma_qp_offsets_present_flag
+    nalGetBits(&br, 1);     //weighted_pred_flag
+    nalGetBits(&br, 1);     //weighted_bipred_flag
+    nalGetBits(&br, 1);     //transquant_bypass_enabled_flag
+    if (nalGetBits(&br, 1)) //tiles_enabled_flag
+        *tiles = true;
+    if (nalGetBits(&br, 1)) //entropy_coding_sync_enabled_flag
+        *wpp = true;
+}
+
+static bool checkHEVCNal(const uint8_t *nal, size_t size, bool *tiles, bool *wpp)
+{
+    if (size < 3 || ((nal[0] >> 1) & 0x3f) != 34 /* PPS_NUT */) {
+        return false;
+    }
+    parseHEVCPPS(nal, size, tiles, wpp);
+    return true;
+}
+
+status_t getHEVCParallelism(const uint8_t *data, size_t size,
+        bool *tiles, bool *wpp)
+{
+    bool found = false;
+
+    *tiles = false;
+    *wpp = false;
+    if (!data) {
+        return ERROR_MALFORMED;
+    }
+
+    if (size > 22 && data[0] == 1) {
+        //hvcC: 22 bytes of header, then arrays of length prefixed nal units
+        const uint8_t *p = data + 23;
+        const uint8_t *end = data + size;
+        int numArrays = data[22];
+
+        for (int i = 0; i < numArrays && end - p >= 3; i++) {
+            int numNalus = (p[1] << 8) | p[2];
+            p += 3;
+            for (int j = 0; j < numNalus && end - p >= 2; j++) {
+                size_t len = (p[0] << 8) | p[1];
+                p += 2;
+                if (len > (size_t)(end - p)) {
+                    return found ? OK : ERROR_MALFORMED;
+                }
+                found |= checkHEVCNal(p, len, tiles, wpp);
+                p += len;
+            }
+        }
+    } else {
+        //annex b: nal units between start codes
+        const uint8_t *nal = NULL;
+
+        for (size_t i = 0; i + 2 < size; i++) {
+            if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+                if (nal) {
+                    found |= checkHEVCNal(nal, data + i - nal, tiles, wpp);
+                }
+                nal = data + i + 3;
+                i += 2;
+            }
+        }
+        if (nal) {
+            found |= checkHEVCNal(nal, data + size - nal, tiles, wpp);
+        }
+    }
+
+    return found ? OK : ERROR_MALFORMED;
+}
+
+//native byte order, the blob never leaves the device
+typedef struct CodecParamsHeader {
+    uint32_t magic;
+    uint32_t version;       //LIBAVCODEC_VERSION_INT of the writer
+    uint32_t header_size;
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    int32_t pix_fmt;
+    int32_t sar_num;
+    int32_t sar_den;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t sample_fmt;
+    int32_t channels;
+    int32_t sample_rate;
+    int32_t block_align;
+    int32_t frame_size;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    int64_t bit_rate;
+    uint64_t channel_layout;
+    int32_t extradata_size;
+    int32_t encoder_delay;
+    int32_t encoder_padding;
+    int32_t reserved;
+} CodecParamsHeader;
+
+static const uint32_t kCodecParamsMagic = 'FFCP';
+
+sp<ABuffer> packCodecParams(const AVCodecContext *avctx,
+        int32_t encoder_delay, int32_t encoder_padding)
+{
+    CodecParamsHeader hdr;
+    int extradata_size = avctx->extradata ? avctx->extradata_size : 0;
+
+    if (extradata_size < 0) {
+        return NULL;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic                 = kCodecParamsMagic;
+    hdr.version               = LIBAVCODEC_VERSION_INT;
+    hdr.header_size           = sizeof(hdr);
+    hdr.codec_type            = avctx->codec_type;
+    hdr.codec_id              = avctx->codec_id;
+    hdr.codec_tag             = avctx->codec_tag;
+    hdr.profile               = avctx->profile;
+    hdr.level                 = avctx->level;
+    hdr.width                 = avctx->width;
+    hdr.height                = avctx->height;
+    hdr.pix_fmt               = avctx->pix_fmt;
+    hdr.sar_num               = avctx->sample_aspect_ratio.num;
+    hdr.sar_den               = avctx->sample_aspect_ratio.den;
+    hdr.time_base_num         = avctx->time_base.num;
+    hdr.time_base_den         = avctx->time_base.den;
+    hdr.sample_fmt            = avctx->sample_fmt;
+    hdr.channels              = avctx->channels;
+    hdr.sample_rate           = avctx->sample_rate;
+    hdr.block_align           = avctx->block_align;
+    hdr.frame_size            = avctx->frame_size;
+    hdr.bits_per_coded_sample = avctx->bits_per_coded_sample;
+    hdr.bits_per_raw_sample   = avctx->bits_per_raw_sample;
+    hdr.bit_rate              = avctx->bit_rate;
+    hdr.channel_layout        = avctx->channel_layout;
+    hdr.extradata_size        = extradata_size;
+    hdr.encoder_delay         = encoder_delay;
+    hdr.encoder_padding       = encoder_padding;
+
+    sp<ABuffer> buffer = new ABuffer(sizeof(hdr) + extradata_size);
+    memcpy(buffer->data(), &hdr, sizeof(hdr));
+    if (extradata_size > 0) {
+        memcpy(buffer->data() + sizeof(hdr), avctx->extradata, extradata_size);
+    }
+
+    return buffer;
+}
+
+status_t unpackCodecParams(AVCodecContext *avctx,
+        const uint8_t *data, size_t size,
+        int32_t *encoder_delay, int32_t *encoder_padding)
+{
+    CodecParamsHeader hdr;
+    uint8_t *extradata = NULL;
+
+    //metadata blobs are not necessarily aligned
+    if (data == NULL || size < sizeof(hdr)) {
+        return ERROR_MALFORMED;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+
+    if (hdr.magic != kCodecParamsMagic || hdr.header_size != sizeof(hdr)) {
+        return ERROR_MALFORMED;
+    }
+    //e.g. the parameters of an audio track for a video decoder
+    if (avctx->codec_type != AVMEDIA_TYPE_UNKNOWN
+            && hdr.codec_type != avctx->codec_type) {
+        return ERROR_UNSUPPORTED;
+    }
+    //codec ids and formats are only meaningful within one build
+    if (hdr.version != LIBAVCODEC_VERSION_INT) {
+        ALOGW("codec params of libavcodec %u.%u.%u, we are %u.%u.%u",
+                hdr.version >> 16, (hdr.version >> 8) & 0xff, hdr.version & 0xff,
+                LIBAVCODEC_VERSION_MAJOR, LIBAVCODEC_VERSION_MINOR,
+                LIBAVCODEC_VERSION_MICRO);
+        return ERROR_UNSUPPORTED;
+    }
+    if (hdr.extradata_size < 0
+            || (size_t)hdr.extradata_size != size - sizeof(hdr)) {
+        return ERROR_MALFORMED;
+    }
+
+    if (hdr.extradata_size > 0) {
+        extradata = (uint8_t *)av_mallocz(hdr.extradata_size
+                + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!extradata) {
+            return NO_MEMORY;
+        }
+        memcpy(extradata, data + sizeof(hdr), hdr.extradata_size);
+    }
+
+    av_freep(&avctx->extradata);
+    avctx->extradata             = extradata;
+    avctx->extradata_size        = hdr.extradata_size;
+
+    avctx->codec_type            = (enum AVMediaType)hdr.codec_type;
+    avctx->codec_id              = (enum AVCodecID)hdr.codec_id;
+    avctx->codec_tag             = hdr.codec_tag;
+    avctx->profile               = hdr.profile;
+    avctx->level                 = hdr.level;
+    avctx->width                 = hdr.width;
+    avctx->height                = hdr.height;
+    avctx->pix_fmt               = (enum AVPixelFormat)hdr.pix_fmt;
+    avctx->sample_aspect_ratio   = av_make_q(hdr.sar_num, hdr.sar_den);
+    avctx->time_base             = av_make_q(hdr.time_base_num, hdr.time_base_den);
+    avctx->sample_fmt            = (enum AVSampleFormat)hdr.sample_fmt;
+    avctx->channels              = hdr.channels;
+    avctx->sample_rate           = hdr.sample_rate;
+    avctx->block_align           = hdr.block_align;
+    avctx->frame_size            = hdr.frame_size;
+    avctx->bits_per_coded_sample = hdr.bits_per_coded_sample;
+    avctx->bits_per_raw_sample   = hdr.bits_per_raw_sample;
+    avctx->bit_rate              = hdr.bit_rate;
+    avctx->channel_layout        = hdr.channel_layout;
+
+    if (encoder_delay) {
+        *encoder_delay = hdr.encoder_delay;
+    }
+    if (encoder_padding) {
+        *encoder_padding = hdr.encoder_padding;
+    }
+
+    return OK;
+}
+
 //Convert H.264 NAL format to annex b
 status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         uint8_t *src, size_t src_size, size_t nal_len_size)
@@ -488,7 +800,9 @@ status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         src += nal_len_size;
         src_size -= nal_len_size;
 
-        memcpy(dst, src, nal_len);
+        if (dst != src) {
+            memcpy(dst, src, nal_len);
+        }
 
         dst += nal_len;
         src += nal_len;
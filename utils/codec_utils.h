@@ -28,6 +28,15 @@
 
 namespace android {
 
+//mime types which MediaDefs doesn't have
+#define FFMPEG_MIMETYPE_VIDEO_VP9 "video/x-vnd.on2.vp9"
+
+//meta keys which MetaData doesn't have
+enum {
+    //raw data, packCodecParams() of the track's AVCodecContext
+    kKeyFFmpegCodecParams = 'ffcp',
+};
+
 //video
 sp<MetaData> setAVCFormat(AVCodecContext *avctx);
 sp<MetaData> setH264Format(AVCodecContext *avctx);
@@ -43,6 +52,7 @@ sp<MetaData> setRV30Format(AVCodecContext *avctx);
 sp<MetaData> setRV40Format(AVCodecContext *avctx);
 sp<MetaData> setFLV1Format(AVCodecContext *avctx);
 sp<MetaData> setHEVCFormat(AVCodecContext *avctx);
+sp<MetaData> setVP9Format(AVCodecContext *avctx);
 //audio
 sp<MetaData> setMP2Format(AVCodecContext *avctx);
 sp<MetaData> setMP3Format(AVCodecContext *avctx);
@@ -58,7 +68,25 @@ sp<MetaData> setAPEFormat(AVCodecContext *avctx);
 sp<MetaData> setDTSFormat(AVCodecContext *avctx);
 sp<MetaData> setFLACFormat(AVCodecContext *avctx);
 
-//Convert H.264 NAL format to annex b
+//Tell whether the HEVC PPSs in extradata (hvcC or annex b) enable tiles
+//or wavefront parallel processing (entropy_coding_sync_enabled_flag)
+status_t getHEVCParallelism(const uint8_t *data, size_t size,
+        bool *tiles, bool *wpp);
+
+//Serialize the decoding parameters of avctx (codec, profile, picture and
+//sample format, channel layout, extradata, ...) for a decoder of the same
+//ffmpeg build, NULL on error. encoder_delay and encoder_padding are the
+//samples an audio decoder drops at the start and the end of the stream.
+sp<ABuffer> packCodecParams(const AVCodecContext *avctx,
+        int32_t encoder_delay = 0, int32_t encoder_padding = 0);
+
+//Restore a packCodecParams() blob into avctx, which is not opened yet.
+//extradata is replaced, ERROR_UNSUPPORTED if another ffmpeg build wrote it
+status_t unpackCodecParams(AVCodecContext *avctx,
+        const uint8_t *data, size_t size,
+        int32_t *encoder_delay = NULL, int32_t *encoder_padding = NULL);
+
+//Convert H.264 NAL format to annex b, dst may be src
 status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         uint8_t *src, size_t src_size, size_t nal_len_size);
 
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FFMPEG_OMX_EXT_H_
+
+#define FFMPEG_OMX_EXT_H_
+
+#include <OMX_Types.h>
+#include <OMX_Core.h>
+#include <OMX_Index.h>
+#include <OMX_Video.h>
+
+/*
+ * Vendor extensions of the OMX.ffmpeg.* components. Clients look the
+ * indices up by name with OMX_GetExtensionIndex(), the values below are
+ * only what the components hand out.
+ */
+
+//////////////////////////////////////////////////////////////////////////////////
+// extension names
+//////////////////////////////////////////////////////////////////////////////////
+
+#define FFMPEG_OMX_INDEX_LOWRES "OMX.ffmpeg.index.lowres"
+#define FFMPEG_OMX_INDEX_ADAPTIVE_PLAYBACK "OMX.ffmpeg.index.prepareForAdaptivePlayback"
+//name used by newer frameworks, the parameter has the same layout
+#define FFMPEG_OMX_INDEX_ANDROID_ADAPTIVE_PLAYBACK \
+    "OMX.google.android.index.prepareForAdaptivePlayback"
+#define FFMPEG_OMX_INDEX_CODEC_PARAMS "OMX.ffmpeg.index.codecParams"
+#define FFMPEG_OMX_INDEX_AUDIO_OUTPUT_CAPS "OMX.ffmpeg.index.audioOutputCaps"
+#define FFMPEG_OMX_INDEX_AUDIO_PASSTHROUGH "OMX.ffmpeg.index.audioPassthrough"
+
+//////////////////////////////////////////////////////////////////////////////////
+// extension indices
+//////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    //far away from the vendor indices of the framework
+    OMX_IndexFFmpegStartUnused = OMX_IndexVendorStartUnused + 0x000F0000,
+    OMX_IndexParamFFmpegLowres,              /**< reference: OMX_FFMPEG_PARAM_LOWRESTYPE */
+    OMX_IndexParamFFmpegAdaptivePlayback,    /**< reference: OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE */
+    OMX_IndexParamFFmpegCodecParams,         /**< reference: OMX_FFMPEG_PARAM_CODECPARAMSTYPE */
+    OMX_IndexParamFFmpegAudioOutputCaps,     /**< reference: OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE */
+    OMX_IndexParamFFmpegAudioPassthrough,    /**< reference: OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE */
+};
+
+//////////////////////////////////////////////////////////////////////////////////
+// coding types which the framework headers don't have
+//////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    OMX_VIDEO_CodingFFmpegStartUnused = OMX_VIDEO_CodingVendorStartUnused + 0x000F0000,
+    OMX_VIDEO_CodingFFmpegVP9,               /**< Google VP9, FFMPEG_MIMETYPE_VIDEO_VP9 */
+};
+
+//32-bit float PCM in OMX_AUDIO_PARAM_PCMMODETYPE.eNumData, with
+//nBitPerSample 32. The value of OMX_NumericalDataFloat of newer frameworks.
+#define OMX_NumericalDataFFmpegFloat ((OMX_NUMERICALDATATYPE)0x7F000001)
+
+//////////////////////////////////////////////////////////////////////////////////
+// parameters
+//////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Decode at a reduced size, e.g. for thumbnails and previews.
+ * The picture is scaled down by 2^nFactor in each dimension, 0 for the
+ * full size. Set it on the input port before the first frame.
+ */
+typedef struct OMX_FFMPEG_PARAM_LOWRESTYPE {
+    OMX_U32 nSize;
+    OMX_VERSIONTYPE nVersion;
+    OMX_U32 nPortIndex;
+    OMX_U32 nFactor;
+} OMX_FFMPEG_PARAM_LOWRESTYPE;
+
+/**
+ * Allocate the output buffers for nMaxFrameWidth x nMaxFrameHeight.
+ * Resolution changes up to that size are then signalled with
+ * OMX_EventPortSettingsChanged(OMX_IndexConfigCommonOutputCrop) only,
+ * without reconfiguring the output port. Set it on the output port
+ * before its buffers are allocated.
+ */
+typedef struct OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE {
+    OMX_U32 nSize;
+    OMX_VERSIONTYPE nVersion;
+    OMX_U32 nPortIndex;
+    OMX_BOOL bEnable;
+    OMX_U32 nMaxFrameWidth;
+    OMX_U32 nMaxFrameHeight;
+} OMX_FFMPEG_PARAM_ADAPTIVEPLAYBACKTYPE;
+
+/**
+ * The kKeyFFmpegCodecParams blob of a FFmpegExtractor track, see
+ * packCodecParams(). The decoder is then opened with the demuxer's own
+ * codec parameters and extradata, codec config buffers are ignored.
+ * Set it on the input port before the first buffer. nSize covers the
+ * structure up to nData plus nDataSize bytes of it.
+ */
+typedef struct OMX_FFMPEG_PARAM_CODECPARAMSTYPE {
+    OMX_U32 nSize;
+    OMX_VERSIONTYPE nVersion;
+    OMX_U32 nPortIndex;
+    OMX_U32 nDataSize;
+    OMX_U8 nData[1];
+} OMX_FFMPEG_PARAM_CODECPARAMSTYPE;
+
+/**
+ * What the audio sink takes natively. The PCM output keeps the source's
+ * channels, layout and rate up to nMaxChannels (at most 8) and
+ * nMaxSampleRate (at most 192000), beyond that it is downmixed or
+ * resampled. The default is stereo at 48 kHz. Set it on the output port
+ * before the input port's format, the PCM parameters of the output port
+ * then tell what comes out.
+ */
+typedef struct OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE {
+    OMX_U32 nSize;
+    OMX_VERSIONTYPE nVersion;
+    OMX_U32 nPortIndex;
+    OMX_U32 nMaxChannels;
+    OMX_U32 nMaxSampleRate;
+} OMX_FFMPEG_PARAM_AUDIOOUTPUTCAPSTYPE;
+
+/**
+ * Compressed passthrough for AC3 and DTS: instead of decoding, every
+ * frame goes out as an IEC 61937 burst in 16-bit stereo PCM at the
+ * stream's sample rate, for a S/PDIF or HDMI receiver to decode. The
+ * output must reach the device bit-exact. Set it on the output port
+ * before the input port's format, other decoders refuse it.
+ */
+typedef struct OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE {
+    OMX_U32 nSize;
+    OMX_VERSIONTYPE nVersion;
+    OMX_U32 nPortIndex;
+    OMX_BOOL bEnable;
+} OMX_FFMPEG_PARAM_AUDIOPASSTHROUGHTYPE;
+
+#endif  // FFMPEG_OMX_EXT_H_
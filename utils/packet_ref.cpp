@@ -0,0 +1,216 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "packet_ref"
+#include <utils/Log.h>
+
+#include <utils/Vector.h>
+#include <cutils/properties.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/time.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "packet_ref.h"
+
+namespace android {
+
+//outstanding references of a source, beyond either limit its oldest are
+//dropped. a pipeline holds some 16 packets between the source and the
+//decoder, in the MediaBuffers, OMX input buffers and decode queues.
+static const int kMaxRefs = 256;
+static const int64_t kMaxRefBytes = 64 * 1024 * 1024;
+
+typedef struct PacketRefEntry {
+    int source;
+    uint64_t id;
+    AVPacket pkt;
+} PacketRefEntry;
+
+static pthread_mutex_t s_ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t s_ref_once = PTHREAD_ONCE_INIT;
+static Vector<PacketRefEntry> s_refs;     //oldest first
+static int s_next_source = 1;
+static uint64_t s_next_id = 1;
+static uint64_t s_cookie;
+static PacketRefStats s_ref_stats;
+
+static void init_cookie()
+{
+    uint64_t cookie = (uint64_t)av_gettime() << 20;
+
+    cookie ^= (uint64_t)getpid() << 40;
+    cookie ^= (uint64_t)(uintptr_t)&s_refs;
+    s_cookie = cookie ? cookie : 1;
+}
+
+bool packet_ref_enabled()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("sys.media.ffmpeg.pktref", value, "0");
+    return atoi(value) != 0;
+}
+
+static void drop_locked(size_t index)
+{
+    PacketRefEntry &entry = s_refs.editItemAt(index);
+
+    av_free_packet(&entry.pkt);
+    s_refs.removeAt(index);
+    s_ref_stats.dropped++;
+}
+
+//make room for size more bytes of source
+static void make_room_locked(int source, int size)
+{
+    for (;;) {
+        size_t oldest = s_refs.size();
+        int refs = 0;
+        int64_t bytes = size;
+
+        for (size_t i = 0; i < s_refs.size(); i++) {
+            if (s_refs[i].source == source) {
+                if (oldest == s_refs.size()) {
+                    oldest = i;
+                }
+                refs++;
+                bytes += s_refs[i].pkt.size;
+            }
+        }
+        if (!refs || (refs < kMaxRefs && bytes <= kMaxRefBytes)) {
+            return;
+        }
+
+        ALOGW("source %d holds %d packets of %lld bytes, dropping the oldest",
+                source, refs, bytes - size);
+        drop_locked(oldest);
+    }
+}
+
+int packet_ref_open_source()
+{
+    int source;
+
+    pthread_mutex_lock(&s_ref_mutex);
+    source = s_next_source++;
+    pthread_mutex_unlock(&s_ref_mutex);
+
+    return source;
+}
+
+void packet_ref_close_source(int source)
+{
+    pthread_mutex_lock(&s_ref_mutex);
+    for (size_t i = s_refs.size(); i > 0; i--) {
+        if (s_refs[i - 1].source == source) {
+            drop_locked(i - 1);
+        }
+    }
+    pthread_mutex_unlock(&s_ref_mutex);
+}
+
+int packet_ref_put(int source, AVPacket *pkt, PacketRefToken *token)
+{
+    PacketRefEntry entry;
+
+    if (!pkt->buf || !pkt->data) {
+        return AVERROR(EINVAL);
+    }
+
+    pthread_once(&s_ref_once, init_cookie);
+
+    pthread_mutex_lock(&s_ref_mutex);
+    make_room_locked(source, pkt->size);
+
+    entry.source = source;
+    entry.id = s_next_id++;
+    entry.pkt = *pkt;
+    s_refs.push(entry);
+
+    token->cookie = s_cookie;
+    token->id = entry.id;
+    token->pid = getpid();
+    token->size = pkt->size;
+    pthread_mutex_unlock(&s_ref_mutex);
+
+    //the registry owns the data now
+    av_init_packet(pkt);
+    pkt->data = NULL;
+    pkt->size = 0;
+
+    return 0;
+}
+
+int packet_ref_take(const uint8_t *data, size_t size, AVPacket *pkt)
+{
+    PacketRefToken token;
+    int ret = AVERROR(ENOENT);
+
+    if (size != sizeof(token)) {
+        return AVERROR(EINVAL);
+    }
+    memcpy(&token, data, sizeof(token));
+
+    pthread_once(&s_ref_once, init_cookie);
+    if (token.cookie != s_cookie || token.pid != getpid()) {
+        return AVERROR(EINVAL);
+    }
+
+    pthread_mutex_lock(&s_ref_mutex);
+    for (size_t i = 0; i < s_refs.size(); i++) {
+        if (s_refs[i].id == token.id) {
+            *pkt = s_refs[i].pkt;
+            s_refs.removeAt(i);
+            s_ref_stats.by_ref++;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_ref_mutex);
+
+    if (ret < 0) {
+        ALOGW("packet %llu of %d bytes is gone", token.id, token.size);
+    }
+    return ret;
+}
+
+void packet_ref_count_copy(int size)
+{
+    pthread_mutex_lock(&s_ref_mutex);
+    s_ref_stats.copies++;
+    s_ref_stats.copied_bytes += size;
+    pthread_mutex_unlock(&s_ref_mutex);
+}
+
+void packet_ref_get_stats(PacketRefStats *stats)
+{
+    pthread_mutex_lock(&s_ref_mutex);
+    *stats = s_ref_stats;
+    pthread_mutex_unlock(&s_ref_mutex);
+}
+
+}  // namespace android
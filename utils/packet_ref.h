@@ -0,0 +1,76 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PACKET_REF_H_
+
+#define PACKET_REF_H_
+
+#include "ffmpeg_utils.h"
+
+namespace android {
+
+//////////////////////////////////////////////////////////////////////////////////
+// in-process packet pass-through
+//
+// FFmpegSource keeps the demuxed packet here and sends a token through
+// the MediaBuffer and the OMX input buffer instead of the payload, an
+// OMX.ffmpeg decoder in the same process swaps the token back for the
+// packet. Only our decoders understand tokens, so it is opt-in:
+// setprop sys.media.ffmpeg.pktref 1, together with sys.media.vdec.sw 1.
+// References are kept per source. Those nobody takes (flushed input, a
+// dead decoder) are dropped with their source, or oldest first once far
+// more are outstanding than a pipeline holds; the decoder which comes to
+// take one of those reports an error.
+//////////////////////////////////////////////////////////////////////////////////
+
+typedef struct PacketRefToken {
+    uint64_t cookie;    //per process, tells tokens from payload
+    uint64_t id;
+    int32_t pid;
+    int32_t size;       //payload size
+} PacketRefToken;
+
+typedef struct PacketRefStats {
+    int64_t by_ref;         //packets handed over by reference
+    int64_t dropped;        //references which were never taken
+    int64_t copies;         //payload copies on the way to a decoder
+    int64_t copied_bytes;
+} PacketRefStats;
+
+//sys.media.ffmpeg.pktref
+bool packet_ref_enabled();
+
+//a source of references, > 0. its references go with it on close.
+int packet_ref_open_source();
+void packet_ref_close_source(int source);
+
+//move *pkt, which must be refcounted, into the registry and describe it
+//in *token. *pkt is blank afterwards. <0 and *pkt untouched on error.
+int packet_ref_put(int source, AVPacket *pkt, PacketRefToken *token);
+
+//if data is a token of this process, move its packet into *pkt and
+//return 0. AVERROR(EINVAL) if it is no token, i.e. plain payload,
+//AVERROR(ENOENT) if the packet was dropped meanwhile.
+int packet_ref_take(const uint8_t *data, size_t size, AVPacket *pkt);
+
+//count a copy of size payload bytes, for the stats
+void packet_ref_count_copy(int size);
+
+void packet_ref_get_stats(PacketRefStats *stats);
+
+}  // namespace android
+
+#endif  // PACKET_REF_H_
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "spdif_packer"
+#include <utils/Log.h>
+
+#include "spdif_packer.h"
+
+namespace android {
+
+struct SpdifPacker {
+    AVFormatContext *oc;
+    uint8_t *burst;     //last burst, from avio_close_dyn_buf()
+};
+
+bool spdif_packer_supported(enum AVCodecID codec_id)
+{
+    return codec_id == AV_CODEC_ID_AC3 || codec_id == AV_CODEC_ID_DTS;
+}
+
+int spdif_carrier_rate(enum AVCodecID codec_id, int sample_rate)
+{
+    //AC3 and DTS core bursts take as many carrier frames as the
+    //compressed frame has samples, E-AC3 would take four times as many
+    (void)codec_id;
+    return sample_rate;
+}
+
+//the muxer writes into a fresh memory buffer each time
+static int open_dyn_buf(AVFormatContext *oc)
+{
+    int ret = avio_open_dyn_buf(&oc->pb);
+    if (ret < 0) {
+        oc->pb = NULL;
+    }
+    return ret;
+}
+
+static int close_dyn_buf(AVFormatContext *oc, uint8_t **buf)
+{
+    int size = avio_close_dyn_buf(oc->pb, buf);
+    oc->pb = NULL;
+    return size;
+}
+
+SpdifPacker *spdif_packer_open(enum AVCodecID codec_id)
+{
+    SpdifPacker *packer = NULL;
+    AVFormatContext *oc = NULL;
+    AVStream *st = NULL;
+    uint8_t *buf = NULL;
+    int ret;
+
+    if (!spdif_packer_supported(codec_id)) {
+        return NULL;
+    }
+
+    ret = avformat_alloc_output_context2(&oc, NULL, "spdif", NULL);
+    if (ret < 0 || !oc) {
+        ALOGE("no spdif muxer (%s)", av_err2str(ret));
+        return NULL;
+    }
+
+    st = avformat_new_stream(oc, NULL);
+    if (!st) {
+        goto fail;
+    }
+    st->codec->codec_type = AVMEDIA_TYPE_AUDIO;
+    st->codec->codec_id = codec_id;
+
+    //nothing is written, but the muxer wants somewhere to write to
+    if (open_dyn_buf(oc) < 0) {
+        goto fail;
+    }
+    ret = avformat_write_header(oc, NULL);
+    close_dyn_buf(oc, &buf);
+    av_freep(&buf);
+    if (ret < 0) {
+        ALOGE("failed to start the spdif muxer (%s)", av_err2str(ret));
+        goto fail;
+    }
+
+    packer = (SpdifPacker *)av_mallocz(sizeof(SpdifPacker));
+    if (!packer) {
+        goto fail;
+    }
+    packer->oc = oc;
+
+    ALOGD("spdif packer for %s", avcodec_get_name(codec_id));
+    return packer;
+
+fail:
+    avformat_free_context(oc);
+    return NULL;
+}
+
+int spdif_packer_pack(SpdifPacker *packer, const uint8_t *frame, int size,
+        const uint8_t **burst, int *burst_size)
+{
+    AVFormatContext *oc = packer->oc;
+    AVPacket pkt;
+    int ret;
+
+    av_freep(&packer->burst);
+    *burst = NULL;
+    *burst_size = 0;
+
+    av_init_packet(&pkt);
+    pkt.data = (uint8_t *)frame;
+    pkt.size = size;
+    pkt.stream_index = 0;
+
+    ret = open_dyn_buf(oc);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = av_write_frame(oc, &pkt);
+    size = close_dyn_buf(oc, &packer->burst);
+    if (ret < 0) {
+        av_freep(&packer->burst);
+        return ret;
+    }
+
+    *burst = packer->burst;
+    *burst_size = size;
+    return 0;
+}
+
+void spdif_packer_close(SpdifPacker **packer)
+{
+    SpdifPacker *p = *packer;
+    uint8_t *buf = NULL;
+
+    if (!p) {
+        return;
+    }
+
+    if (open_dyn_buf(p->oc) >= 0) {
+        av_write_trailer(p->oc);
+        close_dyn_buf(p->oc, &buf);
+        av_freep(&buf);
+    }
+    avformat_free_context(p->oc);
+    av_freep(&p->burst);
+    av_freep(packer);
+}
+
+}  // namespace android
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPDIF_PACKER_H_
+
+#define SPDIF_PACKER_H_
+
+#include "ffmpeg_utils.h"
+
+namespace android {
+
+//////////////////////////////////////////////////////////////////////////////////
+// IEC 61937 packer
+//
+// Wraps compressed AC3 and DTS (core) frames into IEC 61937 bursts, carried
+// as 16-bit little-endian stereo PCM at spdif_carrier_rate(), for a S/PDIF
+// or HDMI receiver to decode. It is libavformat's spdif muxer writing to
+// memory, so the framing is that of "ffmpeg -c copy -f spdif".
+//////////////////////////////////////////////////////////////////////////////////
+
+typedef struct SpdifPacker SpdifPacker;
+
+//AC3 and DTS, the codecs our passthrough supports
+bool spdif_packer_supported(enum AVCodecID codec_id);
+
+//PCM rate which carries a stream of codec_id at sample_rate
+int spdif_carrier_rate(enum AVCodecID codec_id, int sample_rate);
+
+//NULL if the codec is not supported or the muxer is not built in
+SpdifPacker *spdif_packer_open(enum AVCodecID codec_id);
+
+//pack one complete frame. *burst belongs to the packer and stays valid
+//until the next call, *burst_size may be 0. <0 on error, e.g. a frame
+//the muxer can't parse.
+int spdif_packer_pack(SpdifPacker *packer, const uint8_t *frame, int size,
+        const uint8_t **burst, int *burst_size);
+
+//*packer is NULL afterwards
+void spdif_packer_close(SpdifPacker **packer);
+
+}  // namespace android
+
+#endif  // SPDIF_PACKER_H_
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "video_utils"
+#include <utils/Log.h>
+
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libavutil/cpu.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNELS 1
+#endif
+
+//avx2 intrinsics in target("avx2") functions need gcc 4.9 or clang
+#if (defined(__i386__) || defined(__x86_64__)) && defined(AV_CPU_FLAG_AVX2) \
+    && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#endif
+
+#include "video_utils.h"
+
+namespace android {
+
+typedef void (*copy_row_fn)(uint8_t *dst, const uint8_t *src, int width);
+typedef void (*split_row_fn)(uint8_t *dst_u, uint8_t *dst_v,
+        const uint8_t *src, int width);
+typedef void (*merge_row_fn)(uint8_t *dst,
+        const uint8_t *src_u, const uint8_t *src_v, int width);
+
+//////////////////////////////////////////////////////////////////////////////////
+// c
+//////////////////////////////////////////////////////////////////////////////////
+
+static void copy_row_c(uint8_t *dst, const uint8_t *src, int width) {
+    memcpy(dst, src, width);
+}
+
+static void split_row_c(uint8_t *dst_u, uint8_t *dst_v,
+        const uint8_t *src, int width) {
+    for (int i = 0; i < width; i++) {
+        dst_u[i] = src[2 * i];
+        dst_v[i] = src[2 * i + 1];
+    }
+}
+
+static void merge_row_c(uint8_t *dst,
+        const uint8_t *src_u, const uint8_t *src_v, int width) {
+    for (int i = 0; i < width; i++) {
+        dst[2 * i] = src_u[i];
+        dst[2 * i + 1] = src_v[i];
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// neon
+//////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_NEON_KERNELS
+static void copy_row_neon(uint8_t *dst, const uint8_t *src, int width) {
+    int i = 0;
+    for (; i + 32 <= width; i += 32) {
+        uint8x16_t a = vld1q_u8(src + i);
+        uint8x16_t b = vld1q_u8(src + i + 16);
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+    }
+    if (i < width) {
+        memcpy(dst + i, src + i, width - i);
+    }
+}
+
+static void split_row_neon(uint8_t *dst_u, uint8_t *dst_v,
+        const uint8_t *src, int width) {
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        uint8x16x2_t uv = vld2q_u8(src + 2 * i);
+        vst1q_u8(dst_u + i, uv.val[0]);
+        vst1q_u8(dst_v + i, uv.val[1]);
+    }
+    split_row_c(dst_u + i, dst_v + i, src + 2 * i, width - i);
+}
+
+static void merge_row_neon(uint8_t *dst,
+        const uint8_t *src_u, const uint8_t *src_v, int width) {
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        uint8x16x2_t uv;
+        uv.val[0] = vld1q_u8(src_u + i);
+        uv.val[1] = vld1q_u8(src_v + i);
+        vst2q_u8(dst + 2 * i, uv);
+    }
+    merge_row_c(dst + 2 * i, src_u + i, src_v + i, width - i);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// sse2
+//////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_SSE2_KERNELS
+static void copy_row_sse2(uint8_t *dst, const uint8_t *src, int width) {
+    int i = 0;
+    for (; i + 32 <= width; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), b);
+    }
+    if (i < width) {
+        memcpy(dst + i, src + i, width - i);
+    }
+}
+
+static void split_row_sse2(uint8_t *dst_u, uint8_t *dst_v,
+        const uint8_t *src, int width) {
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        __m128i u = _mm_packus_epi16(_mm_and_si128(a, mask),
+                                     _mm_and_si128(b, mask));
+        __m128i v = _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                                     _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(dst_u + i), u);
+        _mm_storeu_si128((__m128i *)(dst_v + i), v);
+    }
+    split_row_c(dst_u + i, dst_v + i, src + 2 * i, width - i);
+}
+
+static void merge_row_sse2(uint8_t *dst,
+        const uint8_t *src_u, const uint8_t *src_v, int width) {
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i u = _mm_loadu_si128((const __m128i *)(src_u + i));
+        __m128i v = _mm_loadu_si128((const __m128i *)(src_v + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(u, v));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(u, v));
+    }
+    merge_row_c(dst + 2 * i, src_u + i, src_v + i, width - i);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// avx2
+//////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void copy_row_avx2(uint8_t *dst, const uint8_t *src, int width) {
+    int i = 0;
+    for (; i + 64 <= width; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+    }
+    if (i < width) {
+        memcpy(dst + i, src + i, width - i);
+    }
+}
+
+__attribute__((target("avx2")))
+static void split_row_avx2(uint8_t *dst_u, uint8_t *dst_v,
+        const uint8_t *src, int width) {
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int i = 0;
+    for (; i + 32 <= width; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+        //packus works per 128-bit lane, put the quadwords back in order
+        __m256i u = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                        _mm256_and_si256(b, mask));
+        __m256i v = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                        _mm256_srli_epi16(b, 8));
+        u = _mm256_permute4x64_epi64(u, 0xd8);
+        v = _mm256_permute4x64_epi64(v, 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst_u + i), u);
+        _mm256_storeu_si256((__m256i *)(dst_v + i), v);
+    }
+    split_row_c(dst_u + i, dst_v + i, src + 2 * i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void merge_row_avx2(uint8_t *dst,
+        const uint8_t *src_u, const uint8_t *src_v, int width) {
+    int i = 0;
+    for (; i + 32 <= width; i += 32) {
+        //unpack works per 128-bit lane, spread the quadwords beforehand
+        __m256i u = _mm256_loadu_si256((const __m256i *)(src_u + i));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src_v + i));
+        u = _mm256_permute4x64_epi64(u, 0xd8);
+        v = _mm256_permute4x64_epi64(v, 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_unpacklo_epi8(u, v));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i + 32), _mm256_unpackhi_epi8(u, v));
+    }
+    merge_row_c(dst + 2 * i, src_u + i, src_v + i, width - i);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// dispatch
+//////////////////////////////////////////////////////////////////////////////////
+
+static pthread_once_t s_kernels_once = PTHREAD_ONCE_INIT;
+static copy_row_fn  s_copy_row  = copy_row_c;
+static split_row_fn s_split_row = split_row_c;
+static merge_row_fn s_merge_row = merge_row_c;
+static const char  *s_kernels_name = "c";
+
+static void init_kernels() {
+    int flags = av_get_cpu_flags();
+
+#if HAVE_NEON_KERNELS
+    if (flags & AV_CPU_FLAG_NEON) {
+        s_copy_row  = copy_row_neon;
+        s_split_row = split_row_neon;
+        s_merge_row = merge_row_neon;
+        s_kernels_name = "neon";
+    }
+#endif
+#if HAVE_SSE2_KERNELS
+    if (flags & AV_CPU_FLAG_SSE2) {
+        s_copy_row  = copy_row_sse2;
+        s_split_row = split_row_sse2;
+        s_merge_row = merge_row_sse2;
+        s_kernels_name = "sse2";
+    }
+#endif
+#if HAVE_AVX2_KERNELS
+    if (flags & AV_CPU_FLAG_AVX2) {
+        s_copy_row  = copy_row_avx2;
+        s_split_row = split_row_avx2;
+        s_merge_row = merge_row_avx2;
+        s_kernels_name = "avx2";
+    }
+#endif
+    (void)flags;
+
+    ALOGI("video kernels: %s", s_kernels_name);
+}
+
+void copy_plane(uint8_t *dst, int dst_stride,
+        const uint8_t *src, int src_stride, int width, int height) {
+    pthread_once(&s_kernels_once, init_kernels);
+
+    //both planes are contiguous, one big copy is the fastest
+    if (dst_stride == width && src_stride == width) {
+        memcpy(dst, src, width * height);
+        return;
+    }
+
+    for (int i = 0; i < height; i++) {
+        s_copy_row(dst, src, width);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+void split_uv_plane(uint8_t *dst_u, int dst_stride_u,
+        uint8_t *dst_v, int dst_stride_v,
+        const uint8_t *src_uv, int src_stride, int width, int height) {
+    pthread_once(&s_kernels_once, init_kernels);
+
+    for (int i = 0; i < height; i++) {
+        s_split_row(dst_u, dst_v, src_uv, width);
+        dst_u  += dst_stride_u;
+        dst_v  += dst_stride_v;
+        src_uv += src_stride;
+    }
+}
+
+void merge_uv_plane(uint8_t *dst_uv, int dst_stride,
+        const uint8_t *src_u, int src_stride_u,
+        const uint8_t *src_v, int src_stride_v, int width, int height) {
+    pthread_once(&s_kernels_once, init_kernels);
+
+    for (int i = 0; i < height; i++) {
+        s_merge_row(dst_uv, src_u, src_v, width);
+        dst_uv += dst_stride;
+        src_u  += src_stride_u;
+        src_v  += src_stride_v;
+    }
+}
+
+const char *video_kernels_name() {
+    pthread_once(&s_kernels_once, init_kernels);
+    return s_kernels_name;
+}
+
+}  // namespace android
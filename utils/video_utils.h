@@ -0,0 +1,50 @@
+/*
+ * Copyright 2012 Michael Chen <omxcodec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VIDEO_UTILS_H_
+
+#define VIDEO_UTILS_H_
+
+#include <stdint.h>
+
+namespace android {
+
+//////////////////////////////////////////////////////////////////////////////////
+// plane copy, the kernels are picked at runtime by cpu flags (NEON/SSE2/AVX2)
+//////////////////////////////////////////////////////////////////////////////////
+
+//copy width bytes of height rows between two strided planes
+void copy_plane(uint8_t *dst, int dst_stride,
+        const uint8_t *src, int src_stride, int width, int height);
+
+//split an interleaved chroma plane (NV12 UV, or NV21 VU with u/v swapped),
+//width is counted in chroma samples, i.e. pairs
+void split_uv_plane(uint8_t *dst_u, int dst_stride_u,
+        uint8_t *dst_v, int dst_stride_v,
+        const uint8_t *src_uv, int src_stride, int width, int height);
+
+//interleave two chroma planes into one (NV12 UV, or NV21 VU with u/v
+//swapped), width is counted in chroma samples, i.e. pairs
+void merge_uv_plane(uint8_t *dst_uv, int dst_stride,
+        const uint8_t *src_u, int src_stride_u,
+        const uint8_t *src_v, int src_stride_v, int width, int height);
+
+//name of the kernel set in use, for logging
+const char *video_kernels_name();
+
+}  // namespace android
+
+#endif  // VIDEO_UTILS_H_